@@ -0,0 +1,12 @@
+TEMPLATE = app
+TARGET = bin/baker
+QT += widgets
+OBJECTS_DIR = build/baker
+MOC_DIR = build/baker
+
+include(core.pri)
+
+HEADERS +=	 src/mainWindow.hpp
+
+SOURCES +=	src/mainWindow.cpp \
+                src/main.cpp
@@ -1,14 +1,10 @@
-TEMPLATE = app
-TARGET = bin/baker
-QT += widgets
+TEMPLATE = subdirs
 
-HEADERS +=	 src/core.hpp \
-                 src/mainWindow.hpp \
-                 src/math.hpp
-
-SOURCES +=	src/core.cpp \
-                src/mainWindow.cpp \
-                src/main.cpp
-			
-INCLUDEPATH = "c:/Program Files/Intel/Embree3 x64/include" "c:/Users/Giulio/Downloads/tinyobjloader-master"
-LIBS += -L"c:/Users/Giulio/Downloads/tinyobjloader-master/BUILD" -L"c:/Program Files/Intel/Embree3 x64/lib" -ltinyobjloader -lembree3
+# bin/baker: Qt GUI. bin/baker_cli: headless batch baker, no QtWidgets.
+# bin/baker_bench: synthetic mesh benchmark, no Qt.
+# bin/baker_server: bake daemon speaking JSON lines on stdin/stdout, no Qt.
+SUBDIRS = gui cli bench server
+gui.file = baker.pro
+cli.file = baker_cli.pro
+bench.file = bench.pro
+server.file = server.pro
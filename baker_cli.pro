@@ -0,0 +1,13 @@
+TEMPLATE = app
+TARGET = bin/baker_cli
+QT -= core gui
+CONFIG += console
+CONFIG -= app_bundle
+OBJECTS_DIR = build/baker_cli
+
+include(core.pri)
+
+HEADERS +=	src/bakeJob.hpp
+
+SOURCES +=	src/bakeJob.cpp \
+			src/cli.cpp
@@ -0,0 +1,11 @@
+TEMPLATE = app
+TARGET = bin/baker_bench
+QT -= core gui
+CONFIG += console
+CONFIG -= app_bundle
+OBJECTS_DIR = build/baker_bench
+DEFINES += VERBOSE=0
+
+include(core.pri)
+
+SOURCES +=	src/bench.cpp
@@ -0,0 +1,25 @@
+# DEFINES += BAKE_STATS=0 compiles the bake statistics counters out
+
+HEADERS +=	 src/bakeStats.hpp \
+                 src/core.hpp \
+                 src/dds.hpp \
+                 src/image.hpp \
+                 src/mesh.hpp \
+                 src/objLoader.hpp \
+                 src/parallel.hpp \
+                 src/postProcess.hpp \
+                 src/tiledMap.hpp \
+                 src/math.hpp
+
+SOURCES +=	src/bakeStats.cpp \
+                src/core.cpp \
+                src/dds.cpp \
+                src/image.cpp \
+                src/mesh.cpp \
+                src/objLoader.cpp \
+                src/postProcess.cpp \
+                src/tiledMap.cpp
+			
+INCLUDEPATH = "c:/Program Files/Intel/Embree3 x64/include" "c:/Users/Giulio/Downloads/tinyobjloader-master"
+LIBS += -L"c:/Users/Giulio/Downloads/tinyobjloader-master/BUILD" -L"c:/Program Files/Intel/Embree3 x64/lib" -ltinyobjloader -lembree3 -lz
+win32: LIBS += -lpsapi
@@ -0,0 +1,15 @@
+TEMPLATE = app
+TARGET = bin/baker_server
+QT -= core gui
+CONFIG += console
+CONFIG -= app_bundle
+OBJECTS_DIR = build/baker_server
+# stdout carries the protocol
+DEFINES += VERBOSE=0
+
+include(core.pri)
+
+HEADERS +=	src/bakeJob.hpp
+
+SOURCES +=	src/bakeJob.cpp \
+			src/server.cpp
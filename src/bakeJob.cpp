@@ -0,0 +1,92 @@
+#include "bakeJob.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <iostream>
+#include <sstream>
+
+bool parseChannels(const std::string& list, unsigned& channels) {
+	channels = 1 << CHANNEL_NORMAL;
+	std::istringstream ls(list);
+	std::string name;
+	while(std::getline(ls, name, ',')) {
+		int c = 0;
+		while(c < CHANNELS_NUM && name != Core::channelName((BakeChannel)c)) ++c;
+		if(c == CHANNELS_NUM) {
+			std::cerr << "Unknown channel " << name << std::endl;
+			return false;
+		}
+		channels |= 1 << c;
+	}
+	return true;
+}
+
+int sppSide(const int spp) {
+	return std::max(1, (int)std::lround(std::sqrt((float)spp)));
+}
+
+const char* formatExtension(const ImageFormat format) {
+	switch(format) {
+		case IMAGE_TIFF_FLOAT:	return ".tif";
+		case IMAGE_DDS_BC5:		return ".dds";
+		default:				return ".png";
+	}
+}
+
+bool matchesFormat(const std::string& out, const ImageFormat format) {
+	std::string ext = out.substr(replaceExtension(out, "").size());
+	std::transform(ext.begin(), ext.end(), ext.begin(), [](const unsigned char c) { return (char)std::tolower(c); });
+	return ext == formatExtension(format) || (format == IMAGE_TIFF_FLOAT && ext == ".tiff");
+}
+
+std::string replaceExtension(const std::string& out, const std::string& suffix) {
+	const size_t dot = out.find_last_of('.');
+	const size_t slash = out.find_last_of("/\\");
+	const size_t base_end = dot != std::string::npos && (slash == std::string::npos || dot > slash) ? dot : out.size();
+	return out.substr(0, base_end) + suffix;
+}
+
+std::string channelPath(const std::string& out, const BakeChannel c) {
+	const std::string ext = out.substr(replaceExtension(out, "").size());
+	return replaceExtension(out, std::string("_") + Core::channelName(c) + ext);
+}
+
+std::string levelPath(const std::string& out, const int size) {
+	const std::string ext = out.substr(replaceExtension(out, "").size());
+	return replaceExtension(out, "_" + std::to_string(size) + ext);
+}
+
+std::string udimPath(const std::string& out, const int udim) {
+	const std::string ext = out.substr(replaceExtension(out, "").size());
+	return replaceExtension(out, "." + std::to_string(udim) + ext);
+}
+
+bool writeBakeOutputs(	Core&				core,
+						const std::string&	out,
+						const ImageFormat	format,
+						const int			pyramid,
+						ImageEncodeStats&	encoded,
+						const std::function<void(const std::string&)>& on_file) {
+	// The smaller sizes are reduced from the baked maps
+	for(int level = 0; level <= pyramid; ++level) {
+		if(level > 0) core.downsampleMaps();
+		const std::string level_out = level == 0 ? out : levelPath(out, core.tex_w);
+		for(int c = 0; c < CHANNELS_NUM; ++c) {
+			if(!(core.channels & (1 << c))) continue;
+			const std::string channel_out = c == CHANNEL_NORMAL ? level_out : channelPath(level_out, (BakeChannel)c);
+			// One file per UDIM tile
+			for(const int udim : core.udim_tiles) {
+				const std::string path = core.udim ? udimPath(channel_out, udim) : channel_out;
+				ImageEncodeStats s;
+				if(!core.writeChannel((BakeChannel)c, path, format, &s, udim))
+					return false;
+				encoded.raw_bytes += s.raw_bytes;
+				encoded.file_bytes += s.file_bytes;
+				encoded.seconds += s.seconds;
+				if(on_file) on_file(path);
+			}
+		}
+	}
+	return true;
+}
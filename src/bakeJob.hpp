@@ -0,0 +1,42 @@
+#ifndef _BAKE_JOB_HPP_
+#define _BAKE_JOB_HPP_
+
+#include <functional>
+#include <string>
+
+#include "core.hpp"
+#include "image.hpp"
+
+// Helpers shared by the headless front ends, the CLI and the bake server
+
+// Parses a comma separated list of channel names into a mask, normal always included
+bool parseChannels(const std::string& list, unsigned& channels);
+
+// Square root of spp, rounded, at least 1
+int sppSide(const int spp);
+
+// Usual file extension of format, with the dot
+const char* formatExtension(const ImageFormat format);
+// Whether the extension of out, in any case, is one used for format
+bool matchesFormat(const std::string& out, const ImageFormat format);
+
+// out with its extension, if any, replaced by suffix
+std::string replaceExtension(const std::string& out, const std::string& suffix);
+// out with _<channel> inserted before the extension
+std::string channelPath(const std::string& out, const BakeChannel c);
+// out with _<size> inserted before the extension
+std::string levelPath(const std::string& out, const int size);
+// out with .<udim> inserted before the extension, as texturing tools expect
+std::string udimPath(const std::string& out, const int udim);
+
+// Writes every baked channel of core to out, for every UDIM tile, then reduces the maps
+// pyramid times and writes every smaller size too. on_file, if set, gets every path written.
+// The encode stats of all the files add up into encoded. Stops at the first failure.
+bool writeBakeOutputs(	Core&				core,
+						const std::string&	out,
+						const ImageFormat	format,
+						const int			pyramid,
+						ImageEncodeStats&	encoded,
+						const std::function<void(const std::string&)>& on_file = nullptr);
+
+#endif
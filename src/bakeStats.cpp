@@ -0,0 +1,50 @@
+#include "bakeStats.hpp"
+
+#include <fstream>
+#include <iostream>
+
+template<typename T>
+static void writeArray(std::ostream& out, const std::vector<T>& values) {
+	out << "[";
+	for(size_t i = 0; i < values.size(); ++i)
+		out << (i > 0 ? ", " : "") << values[i];
+	out << "]";
+}
+
+bool writeBakeStatsJson(const std::string& filename, const BakeStats& stats) {
+	std::ofstream out(filename);
+	if(!out) {
+		std::cerr << "Cannot write " << filename << std::endl;
+		return false;
+	}
+
+	out << "{\n"
+		<< "  \"load_low_s\": "			<< stats.load_low_time << ",\n"
+		<< "  \"load_high_s\": "		<< stats.load_high_time << ",\n"
+		<< "  \"bvh_build_s\": "		<< stats.bvh_build_time << ",\n"
+		<< "  \"bake_s\": "				<< stats.bake_time << ",\n"
+		<< "  \"post_process_s\": "		<< stats.post_process_time << ",\n"
+		<< "  \"encode_s\": "			<< stats.encode_time << ",\n"
+		<< "  \"encode_raw_bytes\": "	<< stats.encode_raw_bytes << ",\n"
+		<< "  \"encode_file_bytes\": "	<< stats.encode_file_bytes << ",\n"
+		<< "  \"texels_visited\": "		<< stats.texels_visited << ",\n"
+		<< "  \"texels_covered\": "		<< stats.texels_covered << ",\n"
+		<< "  \"samples\": "			<< stats.samples << ",\n"
+		<< "  \"rays\": "				<< stats.rays << ",\n"
+		<< "  \"hits\": "				<< stats.hits << ",\n"
+		<< "  \"misses\": "				<< stats.misses << ",\n"
+		<< "  \"retries\": "			<< stats.retries << ",\n"
+		<< "  \"degenerate_tris\": "	<< stats.degenerate_tris << ",\n"
+		<< "  \"triangle_time_us\": {\n"
+		<< "    \"timed\": "			<< stats.timed_tris << ",\n"
+		<< "    \"p50\": "				<< stats.tri_time_p50 << ",\n"
+		<< "    \"p90\": "				<< stats.tri_time_p90 << ",\n"
+		<< "    \"p99\": "				<< stats.tri_time_p99 << ",\n"
+		<< "    \"max\": "				<< stats.tri_time_max << ",\n"
+		<< "    \"slowest\": ";
+	writeArray(out, stats.slowest_tris);
+	out << ",\n    \"log2_histogram\": ";
+	writeArray(out, stats.tri_time_histogram);
+	out << "\n  }\n}\n";
+	return bool(out);
+}
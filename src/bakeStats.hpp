@@ -0,0 +1,52 @@
+#ifndef _BAKE_STATS_HPP_
+#define _BAKE_STATS_HPP_
+
+#include <string>
+#include <vector>
+
+// Build with BAKE_STATS=0 to compile the hit, miss and retry counters and the per triangle
+// timers out of the hot loops. Texel, sample and ray counts are always kept, progress uses them.
+#ifndef BAKE_STATS
+	#define BAKE_STATS 1
+#endif
+
+#if BAKE_STATS
+	#define BAKE_STAT(x) x
+#else
+	#define BAKE_STAT(x)
+#endif
+
+// Statistics of the last bake of a Core
+struct BakeStats {
+	// Wall times of the last run of every phase, seconds. post_process_time sums all the maps.
+	double	load_low_time;
+	double	load_high_time;		// BVH build included
+	double	bvh_build_time;
+	double	bake_time;
+	double	post_process_time;
+	double	encode_time;			// Compression and writing of the maps written by Core::writeChannel
+
+	long long	encode_raw_bytes;
+	long long	encode_file_bytes;
+
+	long long	texels_visited;		// Texels of the rows the rasterizer scanned
+	long long	texels_covered;		// Texels with at least one sample inside a triangle
+	long long	samples;			// Samples inside triangles
+	long long	rays;				// Rays traced, backward and AO rays included
+	long long	hits;				// Samples that found a right way hit
+	long long	misses;				// Samples that did not
+	long long	retries;			// Backward rays after a forward miss or wrong way hit
+	long long	degenerate_tris;	// Low poly triangles without UV area, skipped
+
+	// Bake time per low poly triangle in microseconds, over the triangles that
+	// covered any sample. Packet bakes only, stream bakes trace whole tiles at once.
+	long long				timed_tris;
+	double					tri_time_p50, tri_time_p90, tri_time_p99, tri_time_max;
+	std::vector<int>		slowest_tris;			// Indices, slowest first
+	std::vector<long long>	tri_time_histogram;		// Bucket k counts the times in [2^(k-1), 2^k), bucket 0 those below 1
+};
+
+// Writes stats as a JSON object
+bool writeBakeStatsJson(const std::string& filename, const BakeStats& stats);
+
+#endif
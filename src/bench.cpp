@@ -0,0 +1,370 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "core.hpp"
+#include "objLoader.hpp"
+#include "parallel.hpp"
+
+// Slower than the baseline by more than this fraction is a regression
+#define DEF_BENCH_TOLERANCE 0.1
+
+// Phase times compared against the baseline
+static const char* const timed_phases[] = {"obj_load_s", "normals_s", "bvh_build_s", "bake_s", "post_process_s"};
+
+struct BenchCase {
+	std::string	shape;		// sphere or plane
+	long long	high_tris;	// Requested, the generated mesh is close to it
+};
+
+struct BenchResult {
+	std::string	name;
+	long long	high_tris;
+	double		obj_load_s, normals_s, bvh_build_s, bake_s, post_process_s;
+	long long	rays;
+	double		rays_per_s, texels_per_s;
+	size_t		peak_rss;
+};
+
+static void printUsage() {
+	std::cerr <<
+		"Usage: baker_bench [options]\n"
+		"Bakes deterministic synthetic meshes and times every phase.\n"
+		"Options:\n"
+		"  --shapes <list>       comma separated, sphere and plane (default sphere,plane)\n"
+		"  --tris <list>         high poly triangles per case, k and m suffixes allowed (default 10k,100k,1m)\n"
+		"  --size <n>            map size (default 1024)\n"
+		"  --spp <n>             samples per texel, a square (default 4)\n"
+		"  --threads <n>         0 = one per core (default 0)\n"
+		"  --work-dir <dir>      where the generated OBJs go, existing ones are reused (default .)\n"
+		"  --json <file>         results (default bench.json)\n"
+		"  --baseline <file>     results of an earlier run to compare against\n"
+		"  --tolerance <f>       slowdown over the baseline reported as a regression (default 0.1)\n"
+		"The exit code is 1 if any phase regressed.\n";
+}
+
+static long long parseCount(const std::string& s) {
+	const double v = std::atof(s.c_str());
+	const char suffix = s.empty() ? 0 : s.back();
+	if(suffix == 'k' || suffix == 'K') return (long long)(v*1e3);
+	if(suffix == 'm' || suffix == 'M') return (long long)(v*1e6);
+	return (long long)v;
+}
+
+static std::vector<std::string> split(const std::string& list) {
+	std::vector<std::string> items;
+	std::istringstream ls(list);
+	std::string item;
+	while(std::getline(ls, item, ','))
+		if(!item.empty()) items.push_back(item);
+	return items;
+}
+
+// Smooth deterministic bumps
+static float noise(const float x, const float y, const float z) {
+	return	0.5f*std::sin(7.1f*x + 1.3f)*std::sin(6.3f*y + 0.7f)*std::sin(5.9f*z + 2.1f) +
+			0.3f*std::sin(19.7f*x + 17.3f*y + 0.4f)*std::cos(23.1f*z - 13.7f*x) +
+			0.2f*std::sin(61.3f*x - 53.9f*z)*std::sin(47.1f*y + 59.3f*z);
+}
+
+// Buffered OBJ writer
+class ObjWriter {
+public:
+	explicit ObjWriter(const std::string& filename) : f{fopen(filename.c_str(), "wb")} {}
+	~ObjWriter() { if(f) fclose(f); }
+
+	bool ok() const { return f != nullptr; }
+	void v(const Vec3f& p)		{ fprintf(f, "v %.6f %.6f %.6f\n", p[0], p[1], p[2]); }
+	void vn(const Vec3f& n)		{ fprintf(f, "vn %.6f %.6f %.6f\n", n[0], n[1], n[2]); }
+	void vt(const Vec2f& t)		{ fprintf(f, "vt %.6f %.6f\n", t[0], t[1]); }
+	// 0-based indices, with the UV and normal indices equal to the position ones if present
+	void f3(const long long a, const long long b, const long long c, const bool uv, const bool n) {
+		const long long idx[3] = {a + 1, b + 1, c + 1};
+		fputc('f', f);
+		for(const long long i : idx) {
+			if(uv && n)	fprintf(f, " %lld/%lld/%lld", i, i, i);
+			else if(uv)	fprintf(f, " %lld/%lld", i, i);
+			else if(n)	fprintf(f, " %lld//%lld", i, i);
+			else		fprintf(f, " %lld", i);
+		}
+		fputc('\n', f);
+	}
+
+private:
+	FILE* f;
+};
+
+// Latitude and longitude sphere of radius 1 with a seam, UVs in [0.01, 0.99]. The poles
+// are fans. With displacement the radius is bumped by the noise, and no normals or UVs are written.
+static bool writeSphere(const std::string& filename, const int rings, const bool displaced) {
+	ObjWriter obj(filename);
+	if(!obj.ok()) return false;
+
+	const int segs = 2*rings;
+	const auto at = [&](const int i, const int j) { return (long long)i*(segs + 1) + j; };
+	for(int i = 0; i <= rings; ++i) {
+		const float theta = PI*i / rings;
+		for(int j = 0; j <= segs; ++j) {
+			const float phi = 2*PI*(j % segs) / segs;
+			const Vec3f n{std::sin(theta)*std::cos(phi), std::sin(theta)*std::sin(phi), std::cos(theta)};
+			obj.v(displaced ? (1 + 0.05f*noise(n[0], n[1], n[2]))*n : n);
+			if(!displaced) {
+				obj.vn(n);
+				obj.vt({0.01f + 0.98f*j / segs, 0.01f + 0.98f*(rings - i) / rings});
+			}
+		}
+	}
+	for(int i = 0; i < rings; ++i) {
+		for(int j = 0; j < segs; ++j) {
+			if(i > 0)			obj.f3(at(i, j), at(i + 1, j), at(i, j + 1), !displaced, !displaced);
+			if(i < rings - 1)	obj.f3(at(i, j + 1), at(i + 1, j), at(i + 1, j + 1), !displaced, !displaced);
+		}
+	}
+	return true;
+}
+
+// Unit square grid at z = 0 facing +z, UVs in [0.01, 0.99]. With displacement z is the noise
+// and no normals or UVs are written.
+static bool writePlane(const std::string& filename, const int side, const bool displaced) {
+	ObjWriter obj(filename);
+	if(!obj.ok()) return false;
+
+	const auto at = [&](const int i, const int j) { return (long long)i*(side + 1) + j; };
+	for(int i = 0; i <= side; ++i) {
+		for(int j = 0; j <= side; ++j) {
+			const float x = (float)j / side, y = (float)i / side;
+			obj.v({x, y, displaced ? 0.05f*noise(x, y, 0) : 0});
+			if(!displaced) {
+				obj.vn({0, 0, 1});
+				obj.vt({0.01f + 0.98f*x, 0.01f + 0.98f*y});
+			}
+		}
+	}
+	for(int i = 0; i < side; ++i) {
+		for(int j = 0; j < side; ++j) {
+			obj.f3(at(i, j), at(i, j + 1), at(i + 1, j + 1), !displaced, !displaced);
+			obj.f3(at(i, j), at(i + 1, j + 1), at(i + 1, j), !displaced, !displaced);
+		}
+	}
+	return true;
+}
+
+static bool fileExists(const std::string& filename) {
+	return std::ifstream(filename).good();
+}
+
+// Writes the low and high OBJs of a case unless they exist
+static bool generateCase(const BenchCase& c, const std::string& low, const std::string& high) {
+	if(!fileExists(low)) {
+		std::cout << "Generating " << low << std::endl;
+		const bool ok = c.shape == "sphere" ? writeSphere(low, 32, false) : writePlane(low, 8, false);
+		if(!ok) return false;
+	}
+	if(!fileExists(high)) {
+		std::cout << "Generating " << high << std::endl;
+		// About 4 rings^2 triangles on the sphere and 2 side^2 on the plane
+		const bool ok = c.shape == "sphere" ?
+			writeSphere(high, std::max(4, (int)std::lround(std::sqrt(c.high_tris / 4.0))), true) :
+			writePlane(high, std::max(1, (int)std::lround(std::sqrt(c.high_tris / 2.0))), true);
+		if(!ok) return false;
+	}
+	return true;
+}
+
+static double secondsSince(const std::chrono::steady_clock::time_point& start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static bool runCase(const BenchCase& c, const std::string& dir, const int size, const int spp_side,
+					const int threads_num, BenchResult& r) {
+	std::ostringstream name;
+	name << c.shape << "_" << c.high_tris;
+	r.name = name.str();
+	const std::string low = dir + "/bench_" + c.shape + "_low.obj";
+	const std::string high = dir + "/bench_" + r.name + ".obj";
+	if(!generateCase(c, low, high)) {
+		std::cerr << "Cannot write the meshes of " << r.name << std::endl;
+		return false;
+	}
+
+	// OBJ load and normal generation on their own, then again inside Core for the BVH
+	Mesh mesh;
+	ObjLoadStats stats;
+	auto start = std::chrono::steady_clock::now();
+	if(!loadObjParallel(high, mesh, threads_num, stats)) return false;
+	r.obj_load_s = secondsSince(start);
+	r.high_tris = mesh.trinum;
+
+	start = std::chrono::steady_clock::now();
+	mesh.generateNormals(NORMAL_WEIGHT_ANGLE, threads_num);
+	r.normals_s = secondsSince(start);
+	mesh.clear();
+
+	Core core;
+	core.threads_num = threads_num;
+	core.use_mesh_cache = false;
+	core.tex_w = size;
+	core.tex_h = size;
+	core.spp_side = spp_side;
+	if(!core.loadLowObj(low) || !core.loadHighObj(high)) return false;
+	r.bvh_build_s = core.bvh_build_time;
+
+	core.clearBuffers();
+	start = std::chrono::steady_clock::now();
+	const bool baked = core.generateNormalMap();
+	r.bake_s = secondsSince(start);
+	if(!baked) return false;
+	r.rays = core.bakeProgress().rays;
+
+	std::vector<unsigned char> img((size_t)3*size*size);
+	start = std::chrono::steady_clock::now();
+	core.quantizeMap(img.data(), 3*size);
+	r.post_process_s = secondsSince(start);
+
+	r.rays_per_s = r.bake_s > 0 ? r.rays / r.bake_s : 0;
+	r.texels_per_s = r.bake_s > 0 ? (double)size*size / r.bake_s : 0;
+	r.peak_rss = peakRssBytes();
+	return true;
+}
+
+static void writeJson(std::ostream& out, const std::vector<BenchResult>& results,
+					const int size, const int spp, const int threads_num) {
+	out << "{\n"
+		<< "  \"map_size\": " << size << ",\n"
+		<< "  \"spp\": " << spp << ",\n"
+		<< "  \"threads\": " << threadsFor(threads_num) << ",\n"
+		<< "  \"cases\": [\n";
+	for(size_t i = 0; i < results.size(); ++i) {
+		const BenchResult& r = results[i];
+		out << "    {\"name\": \"" << r.name << "\", \"high_tris\": " << r.high_tris
+			<< ", \"obj_load_s\": " << r.obj_load_s
+			<< ", \"normals_s\": " << r.normals_s
+			<< ", \"bvh_build_s\": " << r.bvh_build_s
+			<< ", \"bake_s\": " << r.bake_s
+			<< ", \"post_process_s\": " << r.post_process_s
+			<< ", \"rays\": " << r.rays
+			<< ", \"rays_per_s\": " << r.rays_per_s
+			<< ", \"texels_per_s\": " << r.texels_per_s
+			<< ", \"peak_rss_mib\": " << r.peak_rss / (1 << 20) << "}"
+			<< (i + 1 < results.size() ? ",\n" : "\n");
+	}
+	out << "  ]\n}\n";
+}
+
+// Value of key in the object of case name in a JSON written by writeJson, negative if missing
+static double baselineValue(const std::string& json, const std::string& name, const std::string& key) {
+	const size_t obj = json.find("\"name\": \"" + name + "\"");
+	if(obj == std::string::npos) return -1;
+	const size_t obj_end = json.find('}', obj);
+	const size_t k = json.find("\"" + key + "\": ", obj);
+	if(k == std::string::npos || k > obj_end) return -1;
+	return std::atof(json.c_str() + k + key.size() + 4);
+}
+
+// Prints every phase against the baseline, returns the number of regressions
+static int compareBaseline(const std::string& json, const std::vector<BenchResult>& results, const double tolerance) {
+	int regressions = 0;
+	for(const BenchResult& r : results) {
+		const double values[] = {r.obj_load_s, r.normals_s, r.bvh_build_s, r.bake_s, r.post_process_s};
+		for(int p = 0; p < 5; ++p) {
+			const double base = baselineValue(json, r.name, timed_phases[p]);
+			if(base < 0) continue;
+			const bool regressed = values[p] > base*(1 + tolerance) && values[p] - base > 1e-3;
+			regressions += regressed;
+			printf("%-20s %-15s %10.4fs %10.4fs %+7.1f%%%s\n", r.name.c_str(), timed_phases[p], base, values[p],
+					base > 0 ? 100*(values[p] - base) / base : 0.0, regressed ? "  REGRESSION" : "");
+		}
+	}
+	return regressions;
+}
+
+int main(int argc, char** argv) {
+	std::vector<std::string> shapes{"sphere", "plane"};
+	std::vector<long long> tris{10000, 100000, 1000000};
+	int size = 1024;
+	int spp = 4;
+	int threads_num = 0;
+	std::string dir = ".";
+	std::string json_file = "bench.json";
+	std::string baseline_file;
+	double tolerance = DEF_BENCH_TOLERANCE;
+
+	for(int i = 1; i < argc; ++i) {
+		const std::string arg = argv[i];
+		if(i + 1 >= argc) {
+			printUsage();
+			return 1;
+		}
+		const std::string val = argv[++i];
+
+		if		(arg == "--shapes")		shapes = split(val);
+		else if	(arg == "--tris") {
+			tris.clear();
+			for(const std::string& t : split(val)) tris.push_back(parseCount(t));
+		}
+		else if	(arg == "--size")		size = std::atoi(val.c_str());
+		else if	(arg == "--spp")		spp = std::atoi(val.c_str());
+		else if	(arg == "--threads")	threads_num = std::atoi(val.c_str());
+		else if	(arg == "--work-dir")	dir = val;
+		else if	(arg == "--json")		json_file = val;
+		else if	(arg == "--baseline")	baseline_file = val;
+		else if	(arg == "--tolerance")	tolerance = std::atof(val.c_str());
+		else {
+			printUsage();
+			return 1;
+		}
+	}
+
+	const int spp_side = std::max(1, (int)std::lround(std::sqrt((float)spp)));
+	if(size <= 0 || tris.empty() || std::any_of(tris.begin(), tris.end(), [](long long t) { return t <= 0; })) {
+		printUsage();
+		return 1;
+	}
+	for(const std::string& s : shapes) {
+		if(s != "sphere" && s != "plane") {
+			std::cerr << "Unknown shape " << s << std::endl;
+			return 1;
+		}
+	}
+
+	std::vector<BenchResult> results;
+	for(const std::string& shape : shapes) {
+		for(const long long t : tris) {
+			BenchResult r{};
+			if(!runCase({shape, t}, dir, size, spp_side, threads_num, r)) {
+				std::cerr << "Case " << shape << " " << t << " failed" << std::endl;
+				return 1;
+			}
+			printf("%-20s load %.3fs, normals %.3fs, BVH %.3fs, bake %.3fs, post %.3fs, %.2f Mrays/s, %.2f Mtexels/s\n",
+					r.name.c_str(), r.obj_load_s, r.normals_s, r.bvh_build_s, r.bake_s, r.post_process_s,
+					r.rays_per_s / 1e6, r.texels_per_s / 1e6);
+			results.push_back(r);
+		}
+	}
+
+	std::ofstream out(json_file);
+	if(!out) {
+		std::cerr << "Cannot write " << json_file << std::endl;
+		return 1;
+	}
+	writeJson(out, results, size, spp_side*spp_side, threads_num);
+
+	if(baseline_file.empty()) return 0;
+	std::ifstream in(baseline_file);
+	if(!in) {
+		std::cerr << "Cannot open baseline " << baseline_file << std::endl;
+		return 1;
+	}
+	const std::string baseline((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	const int regressions = compareBaseline(baseline, results, tolerance);
+	if(regressions > 0) std::cout << regressions << " phases regressed" << std::endl;
+	return regressions > 0 ? 1 : 0;
+}
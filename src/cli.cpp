@@ -0,0 +1,283 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "bakeJob.hpp"
+#include "core.hpp"
+#include "image.hpp"
+
+struct BakeJob {
+	std::string low, high, out;
+	int size;
+	int spp;
+};
+
+static void printUsage() {
+	std::cerr <<
+		"Usage:\n"
+		"  baker_cli --low <low.obj> --high <high.obj> --out <map.png> [--size 2048] [--spp 4]\n"
+		"  baker_cli --manifest <jobs.txt>\n"
+		"Options:\n"
+		"  --threads <n>            bake threads, 0 = one per core (default 0)\n"
+		"  --mode <packet|stream>   ray tracing mode (default packet)\n"
+		"  --bidirectional <0|1>    one ray per sample from behind the low poly surface, keeping the hit\n"
+		"                           nearest to it, instead of a forward and a backward ray (default 0)\n"
+		"  --ray-front <d>          bidirectional ray length in front of the surface, in normal lengths (default 1)\n"
+		"  --ray-back <d>           bidirectional ray length behind the surface (default 1)\n"
+		"  --adaptive <0|1>         refine only the texels that did not converge, up to spp (default 0)\n"
+		"  --adaptive-initial <n>   samples every texel gets before refining (default 4)\n"
+		"  --adaptive-threshold <deg>  spread of the normals above which a texel is refined (default 2)\n"
+		"  --dilation <px>          pixels the UV islands are padded by (default 16)\n"
+		"  --blur <0|1>             3x3 tent filter on the output (default 1)\n"
+		"  --channels <list>        comma separated maps baked from the same rays: normal, height,\n"
+		"                           world_normal, position, curvature, ao (default normal).\n"
+		"                           Maps other than normal go to <out>_<map>.png\n"
+		"  --ao-rays <n>            ambient occlusion rays per sample (default 64)\n"
+		"  --ao-distance <d>        ignore occluders farther than d, 0 = no limit (default 0)\n"
+		"  --ao-tolerance <e>       stop a sample once the standard error of its AO is below e,\n"
+		"                           0 = always trace every ray (default 0.02)\n"
+		"  --format <png|png16|tiff|dds>  8 or 16 bit PNG, float TIFF with the unquantized values,\n"
+		"                           or BC5 DDS with mips (default png). <out> must end in .png,\n"
+		"                           .tif or .tiff, or .dds to match\n"
+		"  --bc-quality <fast|normal|high>  DDS block encoder effort (default normal)\n"
+		"  --compression <0-9>      zlib level of the maps, 0 stores them (default 6)\n"
+		"  --udim <0|1>             bake every UDIM tile the low poly UVs cover in one pass, one file\n"
+		"                           per tile named <out>.<udim>.png (default 0)\n"
+		"  --pyramid <n>            also write n halved sizes reduced from the bake to <out>_<size>.png (default 0)\n"
+		"  --stats <0|1>            write bake statistics to <out>.stats.json (default 1)\n"
+		"  --mesh-cache <0|1>       use binary .bkmesh caches next to the OBJs (default 1)\n"
+		"  --obj-loader <parallel|tinyobj>  OBJ parser (default parallel)\n"
+		"  --normal-weighting <uniform|area|angle>  generated vertex normals weighting (default angle)\n"
+		"  --embree-own-buffers <0|1>      Embree owns the high poly buffers, mesh copies are freed (default 0)\n"
+		"  --embree-compact <0|1>          compact BVH layout (default 0)\n"
+		"  --build-quality <low|medium|high>  BVH build quality (default medium)\n"
+		"  --hi-normals-low-precision <0|1>  32 bit encoded high poly normals (default 0)\n"
+		"Every manifest line is a job: <low.obj> <high.obj> <size> <spp> <out.png>\n"
+		"Empty lines and lines starting with # are skipped.\n";
+}
+
+static bool readManifest(const std::string& filename, std::vector<BakeJob>& jobs) {
+	std::ifstream in(filename);
+	if(!in) {
+		std::cerr << "Cannot open manifest " << filename << std::endl;
+		return false;
+	}
+
+	std::string line;
+	for(int line_num = 1; std::getline(in, line); ++line_num) {
+		std::istringstream ls(line);
+		BakeJob job;
+		if(!(ls >> job.low)) continue;
+		if(job.low[0] == '#') continue;
+		if(!(ls >> job.high >> job.size >> job.spp >> job.out)) {
+			std::cerr << filename << ":" << line_num << ": malformed job" << std::endl;
+			return false;
+		}
+		jobs.push_back(job);
+	}
+	return true;
+}
+
+static bool runJob(Core& core, const BakeJob& job, const ImageFormat format, const int pyramid, const bool write_stats) {
+	// spp is the number of samples per texel, the core wants its square root
+	const int spp_side = sppSide(job.spp);
+	if(spp_side*spp_side != job.spp)
+		std::cerr << "spp " << job.spp << " is not a square, using " << spp_side*spp_side << std::endl;
+
+	core.tex_w = job.size;
+	core.tex_h = job.size;
+	core.spp_side = spp_side;
+
+	const auto start = std::chrono::steady_clock::now();
+	core.clearBuffers();
+	if(!core.generateNormalMap()) {
+		std::cerr << job.out << ": bake failed, nothing written" << std::endl;
+		return false;
+	}
+
+	ImageEncodeStats encoded{};
+	if(!writeBakeOutputs(core, job.out, format, pyramid, encoded))
+		return false;
+
+	if(write_stats && !writeBakeStatsJson(replaceExtension(job.out, ".stats.json"), core.bakeStats()))
+		return false;
+
+	const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	std::cout << job.out << " baked in " << elapsed.count() << "s, average spp " << core.average_spp;
+	if(core.bidirectional_rays) std::cout << ", backward rays saved " << core.retries_saved;
+	std::cout << std::endl;
+	const double mb = encoded.raw_bytes / 1e6;
+	std::cout << "  encoded " << mb << " MB to " << encoded.file_bytes / 1e6 << " MB in " << encoded.seconds << "s";
+	if(encoded.seconds > 0) std::cout << ", " << mb / encoded.seconds << " MB/s";
+	std::cout << std::endl;
+	return true;
+}
+
+int main(int argc, char** argv) {
+	std::vector<BakeJob> jobs;
+	BakeJob single{"", "", "", DEF_TEX_SIZE, DEF_SPP_SIDE*DEF_SPP_SIDE};
+	std::string manifest;
+	int threads_num = 0;
+	BakeMode bake_mode = BAKE_MODE_PACKET;
+	bool adaptive = false;
+	bool bidirectional = false;
+	float ray_front = 1, ray_back = 1;
+	int dilation = DEF_DILATION;
+	bool blur = true;
+	bool write_stats = true;
+	ImageFormat format = IMAGE_PNG8;
+	int compression_level = DEF_COMPRESSION_LEVEL;
+	BcQuality bc_quality = BC_QUALITY_NORMAL;
+	int pyramid = 0;
+	bool udim = false;
+	unsigned channels = 1 << CHANNEL_NORMAL;
+	int ao_rays = DEF_AO_RAYS;
+	float ao_max_distance = 0;
+	float ao_tolerance = 0.02f;
+	int adaptive_initial = 4;
+	float adaptive_threshold = 2;
+	bool use_mesh_cache = true;
+	bool use_parallel_obj_loader = true;
+	NormalWeighting normal_weighting = NORMAL_WEIGHT_ANGLE;
+	bool embree_own_buffers = false;
+	bool embree_compact = false;
+	RTCBuildQuality build_quality = RTC_BUILD_QUALITY_MEDIUM;
+	bool hi_normals_low_precision = false;
+
+	for(int i = 1; i < argc; ++i) {
+		const std::string arg = argv[i];
+		if(i + 1 >= argc) {
+			printUsage();
+			return 1;
+		}
+		const std::string val = argv[++i];
+
+		if		(arg == "--low")		single.low = val;
+		else if	(arg == "--high")		single.high = val;
+		else if	(arg == "--out")		single.out = val;
+		else if	(arg == "--size")		single.size = std::atoi(val.c_str());
+		else if	(arg == "--spp")		single.spp = std::atoi(val.c_str());
+		else if	(arg == "--manifest")	manifest = val;
+		else if	(arg == "--threads")	threads_num = std::atoi(val.c_str());
+		else if	(arg == "--bidirectional")	bidirectional = val != "0";
+		else if	(arg == "--ray-front")		ray_front = std::atof(val.c_str());
+		else if	(arg == "--ray-back")		ray_back = std::atof(val.c_str());
+		else if	(arg == "--adaptive")			adaptive = val != "0";
+		else if	(arg == "--adaptive-initial")	adaptive_initial = std::atoi(val.c_str());
+		else if	(arg == "--adaptive-threshold")	adaptive_threshold = std::atof(val.c_str());
+		else if	(arg == "--dilation")	dilation = std::atoi(val.c_str());
+		else if	(arg == "--blur")		blur = val != "0";
+		else if	(arg == "--stats")		write_stats = val != "0";
+		else if	(arg == "--format" && val == "png")		format = IMAGE_PNG8;
+		else if	(arg == "--format" && val == "png16")	format = IMAGE_PNG16;
+		else if	(arg == "--format" && val == "tiff")	format = IMAGE_TIFF_FLOAT;
+		else if	(arg == "--format" && val == "dds")		format = IMAGE_DDS_BC5;
+		else if	(arg == "--bc-quality" && val == "fast")	bc_quality = BC_QUALITY_FAST;
+		else if	(arg == "--bc-quality" && val == "normal")	bc_quality = BC_QUALITY_NORMAL;
+		else if	(arg == "--bc-quality" && val == "high")	bc_quality = BC_QUALITY_HIGH;
+		else if	(arg == "--udim")		udim = val != "0";
+		else if	(arg == "--pyramid")		pyramid = std::atoi(val.c_str());
+		else if	(arg == "--compression")	compression_level = std::atoi(val.c_str());
+		else if	(arg == "--channels") {
+			if(!parseChannels(val, channels)) return 1;
+		}
+		else if	(arg == "--ao-rays")		ao_rays = std::atoi(val.c_str());
+		else if	(arg == "--ao-distance")	ao_max_distance = std::atof(val.c_str());
+		else if	(arg == "--ao-tolerance")	ao_tolerance = std::atof(val.c_str());
+		else if	(arg == "--mesh-cache")	use_mesh_cache = val != "0";
+		else if	(arg == "--obj-loader" && val == "parallel")	use_parallel_obj_loader = true;
+		else if	(arg == "--obj-loader" && val == "tinyobj")		use_parallel_obj_loader = false;
+		else if	(arg == "--normal-weighting" && val == "uniform")	normal_weighting = NORMAL_WEIGHT_UNIFORM;
+		else if	(arg == "--normal-weighting" && val == "area")		normal_weighting = NORMAL_WEIGHT_AREA;
+		else if	(arg == "--normal-weighting" && val == "angle")		normal_weighting = NORMAL_WEIGHT_ANGLE;
+		else if	(arg == "--embree-own-buffers")		embree_own_buffers = val != "0";
+		else if	(arg == "--embree-compact")			embree_compact = val != "0";
+		else if	(arg == "--hi-normals-low-precision")	hi_normals_low_precision = val != "0";
+		else if	(arg == "--build-quality" && val == "low")		build_quality = RTC_BUILD_QUALITY_LOW;
+		else if	(arg == "--build-quality" && val == "medium")	build_quality = RTC_BUILD_QUALITY_MEDIUM;
+		else if	(arg == "--build-quality" && val == "high")		build_quality = RTC_BUILD_QUALITY_HIGH;
+		else if	(arg == "--mode" && val == "packet")	bake_mode = BAKE_MODE_PACKET;
+		else if	(arg == "--mode" && val == "stream")	bake_mode = BAKE_MODE_STREAM;
+		else {
+			printUsage();
+			return 1;
+		}
+	}
+
+	if(!manifest.empty()) {
+		if(!readManifest(manifest, jobs))
+			return 1;
+	} else if(!single.low.empty() && !single.high.empty() && !single.out.empty()) {
+		jobs.push_back(single);
+	} else {
+		printUsage();
+		return 1;
+	}
+
+	for(const BakeJob& job : jobs) {
+		if(job.size <= 0 || job.spp <= 0) {
+			std::cerr << job.out << ": size and spp must be positive" << std::endl;
+			return 1;
+		}
+		if(!matchesFormat(job.out, format)) {
+			std::cerr << job.out << ": the output of this format needs the extension " << formatExtension(format) << std::endl;
+			return 1;
+		}
+	}
+
+	// Jobs sharing a high poly mesh run one after the other so its BVH is built once
+	std::stable_sort(jobs.begin(), jobs.end(),
+		[](const BakeJob& a, const BakeJob& b) { return a.high < b.high; });
+
+	Core core;
+	core.threads_num = threads_num;
+	core.bake_mode = bake_mode;
+	core.adaptive = adaptive;
+	core.bidirectional_rays = bidirectional;
+	core.ray_front_distance = ray_front;
+	core.ray_back_distance = ray_back;
+	core.map_dilation = dilation;
+	core.map_blur = blur;
+	core.compression_level = compression_level;
+	core.bc_quality = bc_quality;
+	core.udim = udim;
+	core.channels = channels;
+	core.ao_rays = ao_rays;
+	core.ao_max_distance = ao_max_distance;
+	core.ao_tolerance = ao_tolerance;
+	core.adaptive_initial_samples = adaptive_initial;
+	core.adaptive_threshold = adaptive_threshold;
+	core.use_mesh_cache = use_mesh_cache;
+	core.use_parallel_obj_loader = use_parallel_obj_loader;
+	core.normal_weighting = normal_weighting;
+	core.embree_own_buffers = embree_own_buffers;
+	core.embree_compact = embree_compact;
+	core.embree_build_quality = build_quality;
+	core.hi_normals_low_precision = hi_normals_low_precision;
+
+	std::string loaded_low, loaded_high;
+	int failed = 0;
+	for(const BakeJob& job : jobs) {
+		if(job.high != loaded_high) {
+			loaded_high.clear();
+			if(!core.loadHighObj(job.high)) { ++failed; continue; }
+			loaded_high = job.high;
+		}
+		if(job.low != loaded_low) {
+			loaded_low.clear();
+			if(!core.loadLowObj(job.low)) { ++failed; continue; }
+			loaded_low = job.low;
+		}
+		if(!runJob(core, job, format, pyramid, write_stats))
+			++failed;
+	}
+
+	if(failed > 0)
+		std::cerr << failed << " of " << jobs.size() << " jobs failed" << std::endl;
+	return failed > 0 ? 1 : 0;
+}
@@ -1,32 +1,232 @@
+#define TINYOBJLOADER_IMPLEMENTATION
 #include "core.hpp"
+#include "dds.hpp"
+#include "objLoader.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <set>
+
+#include <emmintrin.h>
+
+#include "parallel.hpp"
+
+// Sub-samples of a side x side grid, each one as far as possible from the ones before it,
+// starting from the centre. Every prefix is spread over the whole texel.
+static std::vector<Vec2i> progressiveOrder(const int side) {
+	std::vector<Vec2i> order;
+	std::vector<bool> taken(side*side, false);
+	for(int n = 0; n < side*side; ++n) {
+		int best = -1;
+		float best_d = -1;
+		for(int k = 0; k < side*side; ++k) {
+			if(taken[k]) continue;
+			const float x = k % side + 0.5f, y = k / side + 0.5f;
+			float d = order.empty() ? -std::hypot(x - 0.5f*side, y - 0.5f*side) : 1e30f;
+			for(const Vec2i& o : order)
+				d = std::min(d, std::hypot(x - o[0] - 0.5f, y - o[1] - 0.5f));
+			if(d > best_d) {
+				best = k;
+				best_d = d;
+			}
+		}
+		taken[best] = true;
+		order.push_back({best % side, best / side});
+	}
+	return order;
+}
+
+// Intersection context of bidirectional rays. Embree passes the filter a pointer to context.
+struct BidirContext {
+	RTCIntersectContext	context;
+	Core*				core;
+	float				back;	// Ray distance of the low poly surface
+	BidirHit*			hits;	// Indexed by ray id
+};
+
+// Cosine weighted directions around +z, in the order of the R2 sequence so that every prefix
+// of it is evenly spread over the hemisphere. The x, y and z planes are stride floats apart.
+static std::vector<float> aoDirections(const int count, const int stride) {
+	// Inverse powers of the plastic number
+	const double a1 = 0.7548776662466927, a2 = 0.5698402909980532;
+	std::vector<float> dirs(3*stride, 0);
+	for(int k = 0; k < count; ++k) {
+		const double u1 = std::fmod(0.5 + a1*k, 1.0);
+		const double u2 = std::fmod(0.5 + a2*k, 1.0);
+		const double r = std::sqrt(u1);
+		const double phi = 2*3.14159265358979*u2;
+		dirs[k]				= r*std::cos(phi);
+		dirs[stride + k]	= r*std::sin(phi);
+		dirs[2*stride + k]	= std::sqrt(1 - u1);
+	}
+	return dirs;
+}
 
 Core::Core() :
 	tex_w{DEF_TEX_SIZE}, tex_h{DEF_TEX_SIZE},
-	pix_count(DEF_TEX_SIZE*DEF_TEX_SIZE),
-	tex(3*DEF_TEX_SIZE*DEF_TEX_SIZE),
+	udim{false},
+	channels{1 << CHANNEL_NORMAL},
+	ao_rays{DEF_AO_RAYS},
+	ao_max_distance{0},
+	ao_bias{1e-4f},
+	ao_tolerance{0.02f},
+	map_dilation{DEF_DILATION},
+	map_blur{true},
+	compression_level{DEF_COMPRESSION_LEVEL},
+	bc_quality{BC_QUALITY_NORMAL},
+	spp_side{DEF_SPP_SIDE},
+	use_mesh_cache{true},
+	use_parallel_obj_loader{true},
+	normal_weighting{NORMAL_WEIGHT_ANGLE},
+	embree_own_buffers{false},
+	embree_compact{false},
+	embree_build_quality{RTC_BUILD_QUALITY_MEDIUM},
+	hi_normals_low_precision{false},
+	bvh_build_time{0},
+	bvh_bytes{0},
+	threads_num{0},
+	packet_size{0},
+	bake_mode{BAKE_MODE_PACKET},
+	progressive{false},
+	bidirectional_rays{false},
+	ray_front_distance{1},
+	ray_back_distance{1},
+	adaptive{false},
+	adaptive_initial_samples{4},
+	adaptive_threshold{2},
+	average_spp{0},
+	texels_visited{0},
+	texels_covered{0},
+	retries_saved{0},
+	bake_cancel{false},
+	bake_work_done{0},
+	bake_work_total{0},
+	bake_rays{0},
+	bake_samples{0},
+	bake_start{0},
+	stat_hits{0},
+	stat_misses{0},
+	stat_retries{0},
+	stat_degenerate_tris{0},
+	load_low_time{0},
+	load_high_time{0},
+	bake_time{0},
+	post_process_time{0},
+	encode_time{0},
+	encode_raw_bytes{0},
+	encode_file_bytes{0},
+	hi_pos{nullptr},
+	hi_pos_idx{nullptr},
+	hi_nrm_idx{nullptr},
 	hi_embree_scene{nullptr},
-	hi_embree_device{nullptr} {
+	hi_embree_device{nullptr},
+	hi_embree_bytes{0},
+	hi_extent{0},
+	ao_dirs_stride{0},
+	packet_width{1},
+	pass_sample{-1, -1},
+	refining{false},
+	refine_len2{1} {
 }
 
 Core::~Core() {
+	cancelBake();
+	waitBake();
 	releaseEmbree();
 }
 
-void Core::loadLowObj(std::string filename) {
-	std::vector<tinyobj::shape_t> shapes;
-	loadObj(filename, low_attrib, shapes);
-	low_shape = shapes[0];
+bool Core::loadLowObj(std::string filename) {
+	const auto start = std::chrono::steady_clock::now();
+	if(!loadMesh(filename, low_mesh))
+		return false;
+	if(low_mesh.uvnum == 0) {
+		std::cerr << filename << " has no UVs" << std::endl;
+		low_mesh.clear();
+		return false;
+	}
+	for(size_t c = 0; c < 3*low_mesh.trinum; ++c) {
+		if(low_mesh.uv_idx[c] >= low_mesh.uvnum) {
+			std::cerr << filename << ": triangle " << c / 3 << " has no UVs" << std::endl;
+			low_mesh.clear();
+			return false;
+		}
+	}
+	computeLowTriangles();
+	load_low_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return true;
 }
 
-void Core::loadHighObj(std::string filename) {
-	std::vector<tinyobj::shape_t> shapes;
-	loadObj(filename, hi_attrib, shapes);
-	hi_shape = shapes[0];
+bool Core::loadHighObj(std::string filename) {
+	// Embree shares the mesh buffers, the scene must go first
+	releaseEmbree();
+	const auto start = std::chrono::steady_clock::now();
+	if(!loadMesh(filename, hi_mesh))
+		return false;
 
 	setupEmbree();
+	load_high_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return true;
+}
+
+bool Core::loadMesh(const std::string& filename, Mesh& mesh) {
+	const std::string cache_file = meshCachePath(filename);
+	if(use_mesh_cache && mesh.mapCache(cache_file, filename)) {
+		if(mesh.generated_normals < 0 || mesh.generated_normals == normal_weighting) {
+			if(VERBOSE) std::cout << "Mapped " << cache_file << ", tris: " << mesh.trinum << std::endl;
+			return true;
+		}
+		// Cached normals were generated with another weighting
+		mesh.clear();
+	}
+
+	if(use_parallel_obj_loader) {
+		ObjLoadStats stats;
+		if(!loadObjParallel(filename, mesh, threads_num, stats)) {
+			mesh.clear();
+			return false;
+		}
+		if(VERBOSE) {
+			std::cout << "Loaded " << filename << " (" << stats.bytes / (1 << 20) << " MiB) in "
+					<< stats.scan_time + stats.parse_time << "s (scan " << stats.scan_time
+					<< "s, parse " << stats.parse_time << "s), peak RSS "
+					<< stats.peak_rss / (1 << 20) << " MiB" << std::endl;
+			std::cout << "vnum: " << mesh.vnum << std::endl;
+			std::cout << "nnum: " << mesh.nnum << std::endl;
+			std::cout << "uvnum: " << mesh.uvnum << std::endl;
+			std::cout << "tris: " << mesh.trinum << std::endl;
+		}
+	} else {
+		tinyobj::attrib_t attrib;
+		std::vector<tinyobj::shape_t> shapes;
+		if(!loadObj(filename, attrib, shapes)) {
+			mesh.clear();
+			return false;
+		}
+		mesh.assign(attrib, shapes[0]);
+		if(mesh.nnum == 0 && !attrib.normals.empty())
+			std::cerr << filename << ": some face corners have no valid normal, generating vertex normals" << std::endl;
+	}
+
+	if(mesh.nnum == 0) {
+		// need to generate vertex normals
+		if(VERBOSE) std::cout << "Generating normals..." << std::endl;
+		const auto start = std::chrono::steady_clock::now();
+		mesh.generateNormals(normal_weighting, threads_num);
+		if(VERBOSE) std::cout << "Normals generated in "
+				<< std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()
+				<< "s." << std::endl;
+	}
+
+	if(use_mesh_cache && !mesh.writeCache(cache_file, filename))
+		std::cerr << "Cannot write mesh cache " << cache_file << std::endl;
+	return true;
 }
 
-void Core::loadObj(	std::string						inputfile, 
+bool Core::loadObj(	std::string						inputfile, 
 					tinyobj::attrib_t&				attrib,
 					std::vector<tinyobj::shape_t>&	shapes) {
 
@@ -36,69 +236,9 @@ void Core::loadObj(	std::string						inputfile,
 
 	bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, inputfile.c_str());
 
-	if(!ret)
-		std::cerr << err << std::endl;
-
-	if(attrib.normals.size() == 0) {
-		// need to generate vertex normals
-		std::cout << "Generating normals..." << std::endl;
-
-		// iterate over triangles to get their face normals
-
-		// iterate over vertices of every triangle and average the normals of the adjacent faces
-
-		// to find adjacent faces to a vertex, iterate over faces and look for the vertex index occurencies
-		tinyobj::shape_t& s = shapes[0];
-
-		const int trinum{s.mesh.indices.size() / 3};
-		const int vnum{attrib.vertices.size() / 3};
-		// Initialize blank normals
-		attrib.normals = std::vector<tinyobj::real_t>(vnum*3, 0);
-
-		for (int ti = 0; ti < trinum; ++ti) {
-			const int vidx0 = s.mesh.indices[ti*3 + 0].vertex_index;
-			const int vidx1 = s.mesh.indices[ti*3 + 1].vertex_index;
-			const int vidx2 = s.mesh.indices[ti*3 + 2].vertex_index;
-			s.mesh.indices[ti*3 + 0].normal_index = vidx0;
-			s.mesh.indices[ti*3 + 1].normal_index = vidx1;
-			s.mesh.indices[ti*3 + 2].normal_index = vidx2;
-
-			const Vec3f p0	{attrib.vertices[3*vidx0 + 0],
-							 attrib.vertices[3*vidx0 + 1],
-							 attrib.vertices[3*vidx0 + 2]};
-			const Vec3f p1	{attrib.vertices[3*vidx1 + 0],
-							 attrib.vertices[3*vidx1 + 1],
-							 attrib.vertices[3*vidx1 + 2]};
-			const Vec3f p2	{attrib.vertices[3*vidx2 + 0],
-							 attrib.vertices[3*vidx2 + 1],
-							 attrib.vertices[3*vidx2 + 2]};
-			const Vec3f p01{p1 - p0};
-			const Vec3f p02{p2 - p0};
-			const Vec3f n{normalize(cross(p01, p02))};
-
-			attrib.normals[3*vidx0 + 0] += n[0];
-			attrib.normals[3*vidx0 + 1] += n[1];
-			attrib.normals[3*vidx0 + 2] += n[2];
-			attrib.normals[3*vidx1 + 0] += n[0];
-			attrib.normals[3*vidx1 + 1] += n[1];
-			attrib.normals[3*vidx1 + 2] += n[2];
-			attrib.normals[3*vidx2 + 0] += n[0];
-			attrib.normals[3*vidx2 + 1] += n[1];
-			attrib.normals[3*vidx2 + 2] += n[2];
-		}
-
-		for(int vi = 0; vi < vnum; ++vi) {
-			const Vec3f n{normalize({attrib.normals[3*vi + 0],
-									 attrib.normals[3*vi + 1],
-									 attrib.normals[3*vi + 2]})};
-			attrib.normals[3*vi + 0] = n[0];
-			attrib.normals[3*vi + 1] = n[1];
-			attrib.normals[3*vi + 2] = n[2];
-
-			//std::cout << n << std::endl;
-		}
-
-		std::cout << "Normals generated." << std::endl;
+	if(!ret || shapes.empty()) {
+		std::cerr << "Cannot load " << inputfile << ": " << err << std::endl;
+		return false;
 	}
 
 	// Verbose info printing
@@ -109,6 +249,75 @@ void Core::loadObj(	std::string						inputfile,
 		std::cout << "uvnum: " << (attrib.texcoords.size() / 2) << std::endl;
 		std::cout << "indexes: " << shapes[0].mesh.indices.size() << std::endl;
 	}
+
+	return true;
+}
+
+void Core::computeLowTriangles() {
+	// Tangents follow the MikkTSpace conventions: face tangents from the UV
+	// derivatives, projected on the vertex normal, weighted by the corner
+	// angle and averaged over the corners sharing position, normal, UV and
+	// handedness.
+	const Mesh& m = low_mesh;
+	const int trinum = getLowTrisNum();
+
+	const auto pos = [&](const int c) { return m.position(m.pos_idx[c]); };
+	const auto nor = [&](const int c) { return m.normal(m.nrm_idx[c]); };
+	const auto uv  = [&](const int c) { return m.texcoord(m.uv_idx[c]); };
+
+	std::vector<float>	signs(trinum);
+	std::vector<Vec3f>	face_tang(trinum);
+	for(int ti = 0; ti < trinum; ++ti) {
+		const Vec3f e1 = pos(3*ti + 1) - pos(3*ti + 0);
+		const Vec3f e2 = pos(3*ti + 2) - pos(3*ti + 0);
+		const Vec2f d1 = uv(3*ti + 1) - uv(3*ti + 0);
+		const Vec2f d2 = uv(3*ti + 2) - uv(3*ti + 0);
+		const float det = d1[0]*d2[1] - d2[0]*d1[1];
+		signs[ti] = det < 0 ? -1 : 1;
+		face_tang[ti] = signs[ti]*(d2[1]*e1 - d1[1]*e2);
+	}
+
+	// Corners sharing a vertex are found through the key of their indices
+	std::map<std::array<int, 4>, int> vertex_ids;
+	std::vector<int> corner_vertex(3*trinum);
+	for(int c = 0; c < 3*trinum; ++c) {
+		const std::array<int, 4> key{	(int)m.pos_idx[c], (int)m.nrm_idx[c],
+										(int)m.uv_idx[c], (int)signs[c / 3]};
+		corner_vertex[c] = vertex_ids.emplace(key, vertex_ids.size()).first->second;
+	}
+
+	std::vector<Vec3f> vertex_tang(vertex_ids.size(), Vec3f{0, 0, 0});
+	for(int c = 0; c < 3*trinum; ++c) {
+		const int ti = c / 3;
+		const Vec3f n = normalize(nor(c));
+		const Vec3f t = face_tang[ti] - dot(n, face_tang[ti])*n;
+		if(!(dot(t, t) > 0)) continue;
+
+		const Vec3f ea = pos(3*ti + (c + 1) % 3) - pos(c);
+		const Vec3f eb = pos(3*ti + (c + 2) % 3) - pos(c);
+		const float la = length(ea), lb = length(eb);
+		if(!(la > 0 && lb > 0)) continue;
+		const float angle = std::acos(std::max(-1.0f, std::min(1.0f, dot(ea, eb) / (la*lb))));
+
+		vertex_tang[corner_vertex[c]] = vertex_tang[corner_vertex[c]] + angle*normalize(t);
+	}
+
+	std::vector<Vec3f> tangents(3*trinum);
+	for(int c = 0; c < 3*trinum; ++c) {
+		const Vec3f& t = vertex_tang[corner_vertex[c]];
+		if(dot(t, t) > 0) {
+			tangents[c] = normalize(t);
+		} else {
+			// No UV derivatives: any direction orthogonal to the normal
+			const Mat4 ref = refFromVec(normalize(nor(c)));
+			tangents[c] = {ref(0, 1), ref(1, 1), ref(2, 1)};
+		}
+	}
+
+	low_tris.clear();
+	low_tris.reserve(trinum);
+	for(int ti = 0; ti < trinum; ++ti)
+		low_tris.push_back(Triangle::fromIndex(ti, low_mesh, tangents, signs));
 }
 
 void Core::setupEmbree() {
@@ -121,260 +330,1331 @@ void Core::setupEmbree() {
 		_MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
 	#endif // __INTELLISENSE__
 
-	hi_embree_device = rtcNewDevice(VERBOSE ? "verbose=3" : "verbose=1");
-	hi_embree_scene = rtcNewScene(hi_embree_device);
+	const auto start = std::chrono::steady_clock::now();
+
+	hi_embree_device = rtcNewDevice(VERBOSE ? "verbose=3" : "verbose=0");
+	hi_embree_bytes = 0;
+	rtcSetDeviceMemoryMonitorFunction(hi_embree_device,
+		[](void* ptr, const long long bytes, bool) {
+			*static_cast<std::atomic<long long>*>(ptr) += bytes;
+			return true;
+		}, &hi_embree_bytes);
 
-	int noIndices = hi_shape.mesh.indices.size();
-	std::vector<uint> triangles(noIndices);
-	for(int i = 0; i < noIndices; ++i)
-		triangles[i] = (uint)(hi_shape.mesh.indices[i].vertex_index);
+	hi_embree_scene = rtcNewScene(hi_embree_device);
+	// The context filter is only set on bidirectional rays
+	rtcSetSceneFlags(hi_embree_scene, embree_compact ?
+		RTCSceneFlags(RTC_SCENE_FLAG_COMPACT | RTC_SCENE_FLAG_CONTEXT_FILTER_FUNCTION) :
+		RTC_SCENE_FLAG_CONTEXT_FILTER_FUNCTION);
+	rtcSetSceneBuildQuality(hi_embree_scene, embree_build_quality);
 
-	std::vector<float>&	vertices = hi_attrib.vertices;
 	const auto geom = rtcNewGeometry(hi_embree_device, RTC_GEOMETRY_TYPE_TRIANGLE);
-	rtcSetSharedGeometryBuffer(	geom, RTC_BUFFER_TYPE_VERTEX, 0, 
-								RTC_FORMAT_FLOAT3, vertices.data(),
-								0, 3*sizeof(float), vertices.size() / 3);
-	rtcSetSharedGeometryBuffer(	geom, RTC_BUFFER_TYPE_INDEX, 0, 
-								RTC_FORMAT_UINT3, triangles.data(),
-								0, 3*sizeof(uint), triangles.size() / 3);
+	rtcSetGeometryBuildQuality(geom, embree_build_quality);
+	hi_nrm_idx = hi_mesh.nrm_idx;
+	hi_pos = hi_mesh.pos;
+	hi_pos_idx = hi_mesh.pos_idx;
+
+	if(embree_own_buffers) {
+		float* vertices = static_cast<float*>(rtcSetNewGeometryBuffer(
+								geom, RTC_BUFFER_TYPE_VERTEX, 0,
+								RTC_FORMAT_FLOAT3, 3*sizeof(float), hi_mesh.vnum));
+		uint32_t* triangles = static_cast<uint32_t*>(rtcSetNewGeometryBuffer(
+								geom, RTC_BUFFER_TYPE_INDEX, 0,
+								RTC_FORMAT_UINT3, 3*sizeof(uint32_t), hi_mesh.trinum));
+		std::copy(hi_mesh.pos, hi_mesh.pos + 3*hi_mesh.vnum, vertices);
+		std::copy(hi_mesh.pos_idx, hi_mesh.pos_idx + 3*hi_mesh.trinum, triangles);
+
+		// Per position normals can use Embree's copy of the indices
+		if(std::equal(hi_mesh.pos_idx, hi_mesh.pos_idx + 3*hi_mesh.trinum, hi_mesh.nrm_idx)) {
+			hi_nrm_idx = triangles;
+			hi_mesh.releaseNormalIndices();
+		}
+		hi_pos = vertices;
+		hi_pos_idx = triangles;
+		hi_mesh.releasePositions();
+	} else {
+		// The buffers are shared with the mesh, which may be a mapped cache file
+		rtcSetSharedGeometryBuffer(	geom, RTC_BUFFER_TYPE_VERTEX, 0, 
+									RTC_FORMAT_FLOAT3, hi_mesh.pos,
+									0, 3*sizeof(float), hi_mesh.vnum);
+		rtcSetSharedGeometryBuffer(	geom, RTC_BUFFER_TYPE_INDEX, 0, 
+									RTC_FORMAT_UINT3, hi_mesh.pos_idx,
+									0, 3*sizeof(uint32_t), hi_mesh.trinum);
+	}
+
 	rtcCommitGeometry(geom);
 	rtcAttachGeometry(hi_embree_scene, geom);
 	rtcReleaseGeometry(geom);
 	rtcCommitScene(hi_embree_scene);
 
-	rtcInitIntersectContext(&hi_embree_context);
+	RTCBounds bounds;
+	rtcGetSceneBounds(hi_embree_scene, &bounds);
+	hi_extent = length(Vec3f{bounds.upper_x, bounds.upper_y, bounds.upper_z} -
+						Vec3f{bounds.lower_x, bounds.lower_y, bounds.lower_z});
+
+	hi_oct_normals.clear();
+	if(hi_normals_low_precision) {
+		hi_oct_normals.resize(hi_mesh.nnum);
+		for(size_t ni = 0; ni < hi_mesh.nnum; ++ni)
+			hi_oct_normals[ni] = octEncode(normalize(hi_mesh.normal(ni)));
+		hi_mesh.releaseNormals();
+	}
+
+	bvh_build_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	bvh_bytes = hi_embree_bytes;
+	if(VERBOSE) {
+		std::cout << "BVH built in " << bvh_build_time << "s, Embree memory: "
+				<< bvh_bytes / (1 << 20) << " MiB" << std::endl;
+	}
 }
 
 void Core::releaseEmbree() {
-	std::cout << "Releasing Embree" << std::endl;
+	if(!hi_embree_device) return;
+	if(VERBOSE) std::cout << "Releasing Embree" << std::endl;
 	if(hi_embree_scene) rtcReleaseScene(hi_embree_scene);
 	if(hi_embree_device) rtcReleaseDevice(hi_embree_device);
+	hi_embree_scene = nullptr;
+	hi_embree_device = nullptr;
 }
 
 void Core::clearBuffers() {
-	pix_count = std::vector<int>(tex_w*tex_h, 0),
-	tex = std::vector<float>(3*tex_w*tex_w, 0);
+	// A triangle belongs to the UDIM of its UV centroid. The maps span the columns and rows in use.
+	int columns = 1, rows = 1;
+	udim_tiles = {UDIM_FIRST};
+	udim_skipped.clear();
+	if(udim) {
+		std::set<int> used;
+		int outside = 0;
+		udim_skipped.assign(low_tris.size(), false);
+		for(size_t ti = 0; ti < low_tris.size(); ++ti) {
+			const Triangle& t = low_tris[ti];
+			const float u_mean = (t.uv0[0] + t.uv1[0] + t.uv2[0]) / 3;
+			const float v_mean = (t.uv0[1] + t.uv1[1] + t.uv2[1]) / 3;
+			// Tested in float so huge or NaN UVs do not overflow the conversion
+			if(!(u_mean >= 0 && u_mean < UDIM_COLUMNS && v_mean >= 0 && v_mean < UDIM_ROWS)) {
+				udim_skipped[ti] = true;
+				++outside;
+				continue;
+			}
+			const int u = (int)u_mean;
+			const int v = (int)v_mean;
+			used.insert(UDIM_FIRST + u + UDIM_COLUMNS*v);
+			columns = std::max(columns, u + 1);
+			rows = std::max(rows, v + 1);
+		}
+		if(!used.empty()) udim_tiles.assign(used.begin(), used.end());
+		if(VERBOSE) {
+			std::cout << "UDIM tiles: " << udim_tiles.size() << std::endl;
+			if(outside > 0) std::cout << outside << " triangles outside the UDIM range are skipped" << std::endl;
+		}
+	}
+
+	// The channels not baked get empty maps, which also frees their tiles
+	tex.reset(columns*tex_w, rows*tex_h);
+	for(int c = CHANNEL_NORMAL + 1; c < CHANNELS_NUM; ++c) {
+		const bool baked = channels & (1 << c);
+		channelMap((BakeChannel)c).reset(baked ? columns*tex_w : 0, baked ? rows*tex_h : 0);
+	}
+}
+
+void Core::releaseBuffers() {
+	tex.reset(0, 0);
+	for(TiledMap& m : aux_maps)
+		m.reset(0, 0);
+	reduce_map.reset(0, 0);
 }
 
-void Core::generateNormalMap() {
+std::vector<std::vector<int>> Core::binTrianglesByTile(const int tiles_x, const int tiles_y) {
+	// Every tile gets the list of the triangles whose UV bounding box overlaps it.
+	// The lists are filled in increasing triangle order, so every texel receives
+	// its contributions in the same order as in a serial bake.
+	std::vector<std::vector<int>> bins(tiles_x*tiles_y);
 
-	// For each triangle
 	const auto trinum = getLowTrisNum();
 	for (int ti = 0; ti < trinum; ++ti) {
-		generateNormalMapOnTriangle(ti);
+		if(!udim_skipped.empty() && udim_skipped[ti]) continue;
+		const Triangle& t = low_tris[ti];
+
+		const float u_min = min(t.uv0[0], min(t.uv1[0], t.uv2[0]));
+		const float u_max = max(t.uv0[0], max(t.uv1[0], t.uv2[0]));
+		const float v_min = min(t.uv0[1], min(t.uv1[1], t.uv2[1]));
+		const float v_max = max(t.uv0[1], max(t.uv1[1], t.uv2[1]));
+
+		const int tx0 = std::max(0,				(int)(tex_w * u_min) / DEF_TILE_SIZE);
+		const int tx1 = std::min(tiles_x - 1,	(int)(tex_w * u_max) / DEF_TILE_SIZE);
+		const int ty0 = std::max(0,				(int)(tex_h * v_min) / DEF_TILE_SIZE);
+		const int ty1 = std::min(tiles_y - 1,	(int)(tex_h * v_max) / DEF_TILE_SIZE);
+
+		for(int ty = ty0; ty <= ty1; ++ty)
+			for(int tx = tx0; tx <= tx1; ++tx)
+				bins[tx + ty*tiles_x].push_back(ti);
 	}
 
-	divideMapByCount();
-	
+	return bins;
 }
 
-void Core::generateNormalMapOnTriangle(const int ti) {
+bool Core::generateNormalMap() {
+
+	packet_width = choosePacketWidth();
+	texels_visited = 0;
+	texels_covered = 0;
+	retries_saved = 0;
+	bake_work_done = 0;
+	bake_work_total = 0;
+	bake_rays = 0;
+	bake_samples = 0;
+	bake_start = std::chrono::steady_clock::now().time_since_epoch().count();
+	stat_hits = 0;
+	stat_misses = 0;
+	stat_retries = 0;
+	post_process_time = 0;
+	encode_time = 0;
+	encode_raw_bytes = 0;
+	encode_file_bytes = 0;
+	#if BAKE_STATS
+		stat_tri_ns.reset(new std::atomic<long long>[low_tris.size()]);
+		for(size_t ti = 0; ti < low_tris.size(); ++ti)
+			stat_tri_ns[ti] = 0;
+		stat_degenerate_tris = std::count_if(low_tris.begin(), low_tris.end(), [](const Triangle& t) {
+			const float area = (t.uv1[0] - t.uv0[0])*(t.uv2[1] - t.uv0[1]) - (t.uv2[0] - t.uv0[0])*(t.uv1[1] - t.uv0[1]);
+			return !(std::abs(area) > 0);
+		});
+	#endif
+	if(VERBOSE) {
+		if(bake_mode == BAKE_MODE_STREAM)	std::cout << "Ray stream bake" << std::endl;
+		else								std::cout << "Rays per packet: " << packet_width << std::endl;
+	}
+
+	// The tiles of the maps of all the UDIMs are baked together, in one pass over the same BVH
+	const int tiles_x = tex.tilesX();
+	const int tiles_y = tex.tilesY();
+	const std::vector<std::vector<int>> bins = binTrianglesByTile(tiles_x, tiles_y);
+	long long work_total = 0;
+	for(const auto& bin : bins)
+		work_total += bin.size();
+	bake_work_total = work_total;
+
+	const std::vector<Vec2i> passes = progressive || adaptive ? progressiveOrder(spp_side) : std::vector<Vec2i>{{-1, -1}};
+	bake_work_total = work_total * passes.size();
+	if(channels & (1 << CHANNEL_AO)) {
+		// Padded to whole 16 ray packets
+		ao_dirs_stride = (std::max(ao_rays, 1) + 15) / 16 * 16;
+		ao_dirs = aoDirections(std::max(ao_rays, 1), ao_dirs_stride);
+	}
 
-	const Triangle t = Triangle::fromIndex(ti, low_shape, low_attrib);
-		
-	const Vec2i uv0i{tex_w * t.uv0[0], tex_h * t.uv0[1]};
-	const Vec2i uv1i{tex_w * t.uv1[0], tex_h * t.uv1[1]};
-	const Vec2i uv2i{tex_w * t.uv2[0], tex_h * t.uv2[1]};
+	const float threshold = adaptive_threshold * 3.14159265f / 180;
+	refine_len2 = std::cos(threshold) * std::cos(threshold);
+
+	int passes_done = 0;
+	for(const Vec2i& pass : passes) {
+		pass_sample = pass;
+		refining = adaptive && passes_done >= std::max(1, adaptive_initial_samples);
+		const long long samples_before = bake_samples;
+
+		// A texel belongs to exactly one tile, so no two threads ever write the same
+		// tile of tex and the result is bit-identical to the serial bake.
+		parallelFor(tiles_x*tiles_y, threads_num, [&](const size_t tile) {
+			if(bake_cancel) return;
+			const int tx = tile % tiles_x;
+			const int ty = tile / tiles_x;
+			const Vec2i tile_min{tx*DEF_TILE_SIZE, ty*DEF_TILE_SIZE};
+			const Vec2i tile_max{	std::min(tile_min[0] + DEF_TILE_SIZE, tex.width()) - 1,
+									std::min(tile_min[1] + DEF_TILE_SIZE, tex.height()) - 1};
+			if(bake_mode == BAKE_MODE_STREAM) {
+				generateNormalMapStream(bins[tile], tile_min, tile_max);
+				bake_work_done += bins[tile].size();
+			} else {
+				for(const int ti : bins[tile]) {
+					if(bake_cancel) return;
+					BAKE_STAT(const auto start = std::chrono::steady_clock::now());
+					generateNormalMapOnTriangle(ti, tile_min, tile_max);
+					BAKE_STAT(stat_tri_ns[ti] += std::chrono::nanoseconds(std::chrono::steady_clock::now() - start).count());
+					++bake_work_done;
+				}
+			}
+		});
+		if(bake_cancel) break;
 
-	const Vec2f v01 = t.uv1 - t.uv0;
-	const Vec2f v02 = t.uv2 - t.uv0;
-	// Compute matrix
-	const Mat2 mat = inv({	v01[0], v02[0],
-							v01[1], v02[1]});
+		++passes_done;
+		if(progressive && on_pass) on_pass(passes_done, passes.size());
+
+		// Nothing changed, so the next refinement passes would trace nothing either
+		if(refining && bake_samples == samples_before) break;
+	}
+	pass_sample = {-1, -1};
+	refining = false;
+
+	// Samples per texel with at least one hit
+	long long baked_texels = 0;
+	for(int ty = 0; ty < tex.tilesY(); ++ty) {
+		for(int tx = 0; tx < tex.tilesX(); ++tx) {
+			const TiledMap::Tile* tile = tex.tile(tx, ty);
+			if(tile)
+				baked_texels += std::count_if(tile->count, tile->count + DEF_TILE_SIZE*DEF_TILE_SIZE,
+												[](const int c) { return c > 0; });
+		}
+	}
+	average_spp = baked_texels > 0 ? (double)bake_samples / baked_texels : 0;
+	bake_time = bakeProgress().elapsed;
+
+	if(bake_cancel) {
+		bake_cancel = false;
+		if(VERBOSE) std::cout << "Bake cancelled after " << passes_done << " passes" << std::endl;
+		if(!progressive || passes_done == 0)
+			return false;
+	}
+
+	if(VERBOSE) {
+		std::cout << "Texels visited: " << texels_visited << ", covered: " << texels_covered;
+		if(texels_visited > 0) std::cout << " (" << 100.0 * texels_covered / texels_visited << "%)";
+		std::cout << std::endl;
+		if(bidirectional_rays && bake_mode == BAKE_MODE_PACKET)
+			std::cout << "Backward rays saved by bidirectional rays: " << retries_saved << std::endl;
+		std::cout << "Samples: " << bake_samples << ", average spp: " << average_spp
+				<< " of " << spp_side*spp_side << ", passes: " << passes_done << std::endl;
+		std::cout << "Map tiles touched: " << tex.touchedTiles() << " of " << tex.tilesX()*tex.tilesY()
+				<< " (" << tex.touchedTiles()*sizeof(TiledMap::Tile) / (1 << 20) << " MiB)" << std::endl;
+	}
 	
-	Vec2i min, max;
-
-	min = uv0i;
-	if(uv1i[0] < min[0]) min[0] = uv1i[0];
-	if(uv1i[1] < min[1]) min[1] = uv1i[1];
-	if(uv2i[0] < min[0]) min[0] = uv2i[0];
-	if(uv2i[1] < min[1]) min[1] = uv2i[1];
-
-	max = uv0i;
-	if(uv1i[0] > max[0]) max[0] = uv1i[0];
-	if(uv1i[1] > max[1]) max[1] = uv1i[1];
-	if(uv2i[0] > max[0]) max[0] = uv2i[0];
-	if(uv2i[1] > max[1]) max[1] = uv2i[1];
-
-	// Iterate over texels
-	for(int j = min[1]; j <= max[1]; ++j) {
-		for(int i = min[0]; i <= max[0]; ++i) {
-			//std::cout << "texel " << i << " " << j << std::endl;
-			for(int us = 0; us < DEF_SPP_SIDE; ++us) {
-				for(int vs = 0; vs < DEF_SPP_SIDE; ++vs) {
-
-					// Check if current point is inside
-					const Vec2f uv = {	(i + ((float)us / DEF_SPP_SIDE)) / tex_w,
-										(j + ((float)vs / DEF_SPP_SIDE)) / tex_h};
-					const Vec2f uvt = mat * (uv - t.uv0);
-
-					const float ct = 1 - uvt[0] - uvt[1];
-					const bool inside = uvt[0]	>= 0 && uvt[0]	< 1 &&
-										uvt[1]	>= 0 && uvt[1]	< 1 &&
-										ct		>= 0 && ct		< 1;
-
-					if(inside) {
-						
-						const Vec3f pos = ct*t.p0 + uvt[0]*t.p1 + uvt[1]*t.p2;
-						const Vec3f dir = ct*t.n0 + uvt[0]*t.n1 + uvt[1]*t.n2;
-
-						Vec3f n;
-						Vec3f tn;	// Normal in tangent space.
-						bool hit{shootRay(pos, dir, n)};
-
-						bool wrong_way{true};
-						if(hit) {
-							tn = toTangSpace(n, pos, dir, uv, t);
-							wrong_way = dot(tn, {0,0,1}) < 0;
-						}
-
-						if(wrong_way || !hit) {
-							hit = shootRay(pos, -1*dir, n);
-							tn = toTangSpace(n, pos, dir, uv, t);
-
-							wrong_way = dot(tn, {0,0,1}) < 0;
-						}
-
-						if(hit && !wrong_way) {
-
-							// Color texture
-							tex[3*(i + j*tex_w) + 0] += tn[0];
-							tex[3*(i + j*tex_w) + 1] += tn[1];
-							tex[3*(i + j*tex_w) + 2] += tn[2];
-
-							pix_count[i + j*tex_w] += 1;
-						}
-
-					}
+	return true;
+}
+
+void Core::startNormalMap(const std::function<void(bool)>& on_done) {
+	waitBake();
+	bake_work_done = 0;
+	bake_work_total = 0;
+	bake_thread = std::thread([this, on_done]() {
+		const bool done = generateNormalMap();
+		if(on_done) on_done(done);
+	});
+}
+
+void Core::cancelBake() {
+	bake_cancel = true;
+}
+
+void Core::waitBake() {
+	if(!bake_thread.joinable()) return;
+	bake_thread.join();
+	// The cancel was meant for the bake that just ended
+	bake_cancel = false;
+}
+
+BakeProgress Core::bakeProgress() const {
+	BakeProgress p;
+	p.work_done		= bake_work_done;
+	p.work_total	= bake_work_total;
+	p.rays			= bake_rays;
+	const std::chrono::steady_clock::time_point start{std::chrono::steady_clock::duration{bake_start}};
+	p.elapsed		= std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	p.eta			= p.work_done > 0 ? p.elapsed * (p.work_total - p.work_done) / p.work_done : -1;
+	return p;
+}
+
+BakeStats Core::bakeStats() const {
+	BakeStats s{};
+	s.load_low_time		= load_low_time;
+	s.load_high_time	= load_high_time;
+	s.bvh_build_time	= bvh_build_time;
+	s.bake_time			= bake_time;
+	s.post_process_time	= post_process_time;
+	s.encode_time		= encode_time;
+	s.encode_raw_bytes	= encode_raw_bytes;
+	s.encode_file_bytes	= encode_file_bytes;
+	s.texels_visited	= texels_visited;
+	s.texels_covered	= texels_covered;
+	s.samples			= bake_samples;
+	s.rays				= bake_rays;
+	s.hits				= stat_hits;
+	s.misses			= stat_misses;
+	s.retries			= stat_retries;
+	s.degenerate_tris	= stat_degenerate_tris;
+
+	if(!stat_tri_ns) return s;
+	std::vector<std::pair<long long, int>> times;
+	for(size_t ti = 0; ti < low_tris.size(); ++ti)
+		if(stat_tri_ns[ti] > 0) times.push_back({stat_tri_ns[ti], (int)ti});
+	s.timed_tris = times.size();
+	if(times.empty()) return s;
+
+	std::sort(times.begin(), times.end(), std::greater<std::pair<long long, int>>());
+	const auto percentile = [&](const double p) {
+		return times[std::min(times.size() - 1, (size_t)((1 - p)*times.size()))].first / 1e3;
+	};
+	s.tri_time_p50 = percentile(0.5);
+	s.tri_time_p90 = percentile(0.9);
+	s.tri_time_p99 = percentile(0.99);
+	s.tri_time_max = times[0].first / 1e3;
+	for(size_t k = 0; k < std::min<size_t>(times.size(), 16); ++k)
+		s.slowest_tris.push_back(times[k].second);
+	for(const auto& t : times) {
+		int bucket = 0;
+		for(long long us = t.first / 1000; us > 0; us >>= 1) ++bucket;
+		if((int)s.tri_time_histogram.size() <= bucket) s.tri_time_histogram.resize(bucket + 1, 0);
+		++s.tri_time_histogram[bucket];
+	}
+	return s;
+}
+
+template<int SPP_SIDE, typename OnSample, typename OnRowEnd>
+void Core::rasterizeTriangleSpp(	const Triangle& t, const Vec2i& tile_min, const Vec2i& tile_max,
+									OnSample on_sample, OnRowEnd on_row_end) {
+
+	// 0 is the generic kernel
+	const int side = SPP_SIDE > 0 ? SPP_SIDE : spp_side;
+
+	// The rasterizer works on the sample grid: sample (X, Y) is sub-sample
+	// (X % side, Y % side) of texel (X / side, Y / side).
+	// Sample coordinates are integers, so they are exact in float.
+	const float sx = (float)tex_w * side;
+	const float sy = (float)tex_h * side;
+	const Vec2f v[3] = {{t.uv0[0]*sx, t.uv0[1]*sy},
+						{t.uv1[0]*sx, t.uv1[1]*sy},
+						{t.uv2[0]*sx, t.uv2[1]*sy}};
+
+	// Refinement passes only trace the texels that have not converged. A tile without hits has none.
+	const TiledMap::Tile* refine_tile = nullptr;
+	if(refining) {
+		refine_tile = tex.tile(tile_min[0] / DEF_TILE_SIZE, tile_min[1] / DEF_TILE_SIZE);
+		if(!refine_tile) return;
+	}
+
+	// Twice the signed area. Degenerate UV triangles cover nothing.
+	float area = (v[1][0] - v[0][0])*(v[2][1] - v[0][1]) - (v[2][0] - v[0][0])*(v[1][1] - v[0][1]);
+	if(!(std::abs(area) > 0)) return;
+
+	// Edge k goes from vertex k+1 to vertex k+2, so E_k / area is the barycentric weight of vertex k.
+	// E_k(x, y) = a*x + b*y + c. The edge shared with a neighbour gets exactly negated coefficients.
+	float ea[3], eb[3], ec[3];
+	bool top_left[3];
+	for(int k = 0; k < 3; ++k) {
+		const Vec2f& vs = v[(k + 1) % 3];
+		const Vec2f& ve = v[(k + 2) % 3];
+		ea[k] = vs[1] - ve[1];
+		eb[k] = ve[0] - vs[0];
+		ec[k] = vs[0]*ve[1] - ve[0]*vs[1];
+		if(area < 0) {
+			ea[k] = -ea[k];
+			eb[k] = -eb[k];
+			ec[k] = -ec[k];
+		}
+		// Fill rule: samples exactly on an edge belong to only one of the two triangles sharing it
+		top_left[k] = ea[k] > 0 || (ea[k] == 0 && eb[k] > 0);
+	}
+	const float inv_area = 1 / std::abs(area);
+
+	// Bounding box in samples, clipped to the requested region of the map
+	const int x_min = std::max(tile_min[0]*side,				(int)std::floor(min(v[0][0], min(v[1][0], v[2][0]))));
+	const int x_max = std::min((tile_max[0] + 1)*side - 1,	(int)std::ceil (max(v[0][0], max(v[1][0], v[2][0]))));
+	const int y_min = std::max(tile_min[1]*side,				(int)std::floor(min(v[0][1], min(v[1][1], v[2][1]))));
+	const int y_max = std::min((tile_max[1] + 1)*side - 1,	(int)std::ceil (max(v[0][1], max(v[1][1], v[2][1]))));
+	if(x_min > x_max || y_min > y_max) return;
+
+	const __m128 zero	= _mm_setzero_ps();
+	const __m128 lanes	= _mm_setr_ps(0, 1, 2, 3);
+	__m128 a[3];
+	for(int k = 0; k < 3; ++k)
+		a[k] = _mm_set1_ps(ea[k]);
+
+	// Texels of the current texel row hit by at least one sample. The region is one map tile at most.
+	const int i_min = x_min / side;
+	const int covered_width = x_max / side - i_min + 1;
+	unsigned char covered[DEF_TILE_SIZE];
+	long long visited_num = 0, covered_num = 0, samples_num = 0;
+
+	alignas(16) float w[3][8];
+
+	for(int j = y_min / side; j <= y_max / side; ++j) {
+		int row_l = x_max + 1, row_r = x_min - 1;
+		std::fill(covered, covered + covered_width, 0);
+
+		for(int y = std::max(y_min, j*side); y <= std::min(y_max, (j + 1)*side - 1); ++y) {
+			if(pass_sample[1] >= 0 && y % side != pass_sample[1]) continue;
+
+			// Span of the row where every edge function can be non negative.
+			// It is conservative, the exact test is done per sample below.
+			float row[3];
+			int l = x_min, r = x_max;
+			for(int k = 0; k < 3; ++k) {
+				row[k] = eb[k]*y + ec[k];
+				const float cross = -row[k] / ea[k];
+				if(ea[k] > 0)		l = std::max(l, (int)max(x_min, std::floor(cross) - 1));
+				else if(ea[k] < 0)	r = std::min(r, (int)min(x_max, std::ceil (cross) + 1));
+				else if(row[k] < 0 || (row[k] == 0 && !top_left[k])) r = l - 1;
+			}
+			if(l > r) continue;
+			row_l = std::min(row_l, l);
+			row_r = std::max(row_r, r);
+
+			__m128 rb[3];
+			for(int k = 0; k < 3; ++k)
+				rb[k] = _mm_set1_ps(row[k]);
+			const __m128 r_max = _mm_set1_ps(r);
+
+			// Eight samples per step. The sample x coordinate is stepped exactly, and every
+			// edge function is evaluated as a*x + row so shared edges are classified identically.
+			__m128 x_lo = _mm_add_ps(_mm_set1_ps(l), lanes);
+			const __m128 step = _mm_set1_ps(4);
+			for(int x = l; x <= r; x += 8) {
+				const __m128 x_hi = _mm_add_ps(x_lo, step);
+				__m128 e_lo[3], e_hi[3];
+				__m128 in_lo = _mm_cmple_ps(x_lo, r_max);
+				__m128 in_hi = _mm_cmple_ps(x_hi, r_max);
+				for(int k = 0; k < 3; ++k) {
+					e_lo[k] = _mm_add_ps(_mm_mul_ps(a[k], x_lo), rb[k]);
+					e_hi[k] = _mm_add_ps(_mm_mul_ps(a[k], x_hi), rb[k]);
+					in_lo = _mm_and_ps(in_lo, top_left[k] ? _mm_cmpge_ps(e_lo[k], zero) : _mm_cmpgt_ps(e_lo[k], zero));
+					in_hi = _mm_and_ps(in_hi, top_left[k] ? _mm_cmpge_ps(e_hi[k], zero) : _mm_cmpgt_ps(e_hi[k], zero));
+				}
+				const int mask = _mm_movemask_ps(in_lo) | (_mm_movemask_ps(in_hi) << 4);
+				x_lo = _mm_add_ps(x_hi, step);
+				if(!mask) continue;
+
+				const __m128 ia = _mm_set1_ps(inv_area);
+				for(int k = 0; k < 3; ++k) {
+					_mm_store_ps(w[k] + 0, _mm_mul_ps(e_lo[k], ia));
+					_mm_store_ps(w[k] + 4, _mm_mul_ps(e_hi[k], ia));
+				}
+
+				for(int lane = 0; lane < 8; ++lane) {
+					if(!(mask & (1 << lane))) continue;
+					const int xs = x + lane;
+					if(pass_sample[0] >= 0 && xs % side != pass_sample[0]) continue;
+					const int i = xs / side;
+					const int texel = (i - tile_min[0]) + (j - tile_min[1])*DEF_TILE_SIZE;
+					if(refine_tile && !needsRefinement(*refine_tile, texel)) continue;
+					covered[i - i_min] = 1;
+					++samples_num;
+
+					const float ct = w[0][lane];
+					const Vec2f uvt{w[1][lane], w[2][lane]};
+					BakeSample s;
+					s.pos	= ct*t.p0 + uvt[0]*t.p1 + uvt[1]*t.p2;
+					s.dir	= ct*t.n0 + uvt[0]*t.n1 + uvt[1]*t.n2;
+					s.tang	= ct*t.t0 + uvt[0]*t.t1 + uvt[1]*t.t2;
+					s.uv	= {xs / sx, y / sy};
+					s.texel	= texel;
+					on_sample(s);
 				}
 			}
 		}
+
+		if(row_l <= row_r) {
+			visited_num += row_r / side - row_l / side + 1;
+			for(int k = 0; k < covered_width; ++k)
+				covered_num += covered[k];
+		}
+		on_row_end();
 	}
+
+	texels_visited += visited_num;
+	texels_covered += covered_num;
+	bake_samples += samples_num;
 }
 
-void Core::divideMapByCount() {
+bool Core::needsRefinement(const TiledMap::Tile& tile, const int texel) const {
+	// Only misses so far
+	const int count = tile.count[texel];
+	if(count == 0) return false;
+
+	// The mean of unit normals gets shorter as they spread
+	const Vec3f sum{tile.rgb[3*texel + 0], tile.rgb[3*texel + 1], tile.rgb[3*texel + 2]};
+	return dot(sum, sum) < refine_len2 * count*count;
+}
+
+template<typename OnSample, typename OnRowEnd>
+void Core::rasterizeTriangle(	const Triangle& t, const Vec2i& tile_min, const Vec2i& tile_max,
+								OnSample on_sample, OnRowEnd on_row_end) {
+	// The common grid sides get their own kernel, where texel and sub-sample indices need no division
+	switch(spp_side) {
+		case 1:		rasterizeTriangleSpp<1>(t, tile_min, tile_max, on_sample, on_row_end); break;
+		case 2:		rasterizeTriangleSpp<2>(t, tile_min, tile_max, on_sample, on_row_end); break;
+		case 3:		rasterizeTriangleSpp<3>(t, tile_min, tile_max, on_sample, on_row_end); break;
+		case 4:		rasterizeTriangleSpp<4>(t, tile_min, tile_max, on_sample, on_row_end); break;
+		default:	rasterizeTriangleSpp<0>(t, tile_min, tile_max, on_sample, on_row_end);
+	}
+}
+
+
+void Core::generateNormalMapOnTriangle(const int ti, const Vec2i& tile_min, const Vec2i& tile_max) {
+
+	const Triangle& t = low_tris[ti];
+
+	// Samples are gathered in small blocks of neighbouring texels and traced together
+	BakeSample block[DEF_BLOCK_SIZE];
+	int block_size = 0;
+
+	const auto flush = [&]() {
+		if(block_size > 0) shootSamples(t, block, block_size, tile_min);
+		block_size = 0;
+	};
+
+	rasterizeTriangle(t, tile_min, tile_max,
+		[&](const BakeSample& s) {
+			block[block_size++] = s;
+			if(block_size == DEF_BLOCK_SIZE) flush();
+		},
+		// Do not let a block span two rows
+		flush);
+}
+
+void Core::generateNormalMapStream(const std::vector<int>& tris, const Vec2i& tile_min, const Vec2i& tile_max) {
+
+	// Stage one: generate the ray records of the whole batch
+	std::vector<BakeSample>	stream;
+	for(const int ti : tris) {
+		rasterizeTriangle(low_tris[ti], tile_min, tile_max,
+			[&](const BakeSample& s) {
+				stream.push_back(s);
+				stream.back().tri = ti;
+			},
+			[](){});
+	}
+	const int count = stream.size();
+	if(count == 0) return;
+
+	// Stage two: bin the rays by direction octant and origin cell, then trace the bins in order
+	Vec3f lo{stream[0].pos}, hi{stream[0].pos};
+	for(const BakeSample& s : stream) {
+		for(int c = 0; c < 3; ++c) {
+			lo[c] = min(lo[c], s.pos[c]);
+			hi[c] = max(hi[c], s.pos[c]);
+		}
+	}
+	const int cells = DEF_STREAM_CELLS;
+	Vec3f cell_scale;
+	for(int c = 0; c < 3; ++c)
+		cell_scale[c] = hi[c] > lo[c] ? cells / (hi[c] - lo[c]) : 0;
+
+	const auto binOf = [&](const Vec3f& pos, const Vec3f& dir) {
+		const int octant = (dir[0] < 0) | ((dir[1] < 0) << 1) | ((dir[2] < 0) << 2);
+		int cell = 0;
+		for(int c = 0; c < 3; ++c)
+			cell = cell*cells + std::min(cells - 1, (int)((pos[c] - lo[c]) * cell_scale[c]));
+		return octant*cells*cells*cells + cell;
+	};
+
+	std::vector<RTCRayHit>	rays(count);
+	std::vector<int>		order(count);
+	std::vector<int>		bin(count);
+	std::vector<int>		bin_start(8*cells*cells*cells + 1);
+	std::vector<bool>		hit(count);
+	std::vector<bool>		flipped(count, false);
+	std::vector<HiHit>		hits(count);
+	std::vector<Vec3f>		tn(count);	// Normals in tangent space.
+
+	RTCIntersectContext context;
+	rtcInitIntersectContext(&context);
+	context.flags = RTC_INTERSECT_CONTEXT_FLAG_COHERENT;
+
+	// Traces the records listed in active with the direction sign given by flip
+	const auto trace = [&](const std::vector<int>& active, const bool flip) {
+		// Counting sort of the active records by bin
+		std::fill(bin_start.begin(), bin_start.end(), 0);
+		for(const int si : active) {
+			const Vec3f dir = flip ? -1*stream[si].dir : stream[si].dir;
+			bin[si] = binOf(stream[si].pos, dir);
+			++bin_start[bin[si] + 1];
+		}
+		for(size_t b = 1; b < bin_start.size(); ++b)
+			bin_start[b] += bin_start[b - 1];
+		for(const int si : active)
+			order[bin_start[bin[si]]++] = si;
+
+		const int m = active.size();
+		for(int k = 0; k < m; ++k) {
+			const BakeSample& s = stream[order[k]];
+			const Vec3f dir = flip ? -1*s.dir : s.dir;
+			RTCRayHit& rayhit = rays[k];
+			rayhit.ray.org_x = s.pos[0];
+			rayhit.ray.org_y = s.pos[1];
+			rayhit.ray.org_z = s.pos[2];
+			rayhit.ray.dir_x = dir[0];
+			rayhit.ray.dir_y = dir[1];
+			rayhit.ray.dir_z = dir[2];
+			rayhit.ray.flags = 0;
+			rayhit.ray.mask	 = 0xFFFFFFFF;
+			rayhit.ray.time	 = 0;
+			rayhit.ray.tnear = 0;
+			rayhit.ray.tfar	 = 1;
+			rayhit.hit.geomID = RTC_INVALID_GEOMETRY_ID;
+		}
+
+		rtcIntersect1M(hi_embree_scene, &context, rays.data(), m, sizeof(RTCRayHit));
+
+		for(int k = 0; k < m; ++k) {
+			const int si = order[k];
+			const BakeSample& s = stream[si];
+			hit[si] = rays[k].hit.geomID != RTC_INVALID_GEOMETRY_ID;
+			if(!hit[si]) continue;
+			HiHit& h = hits[si];
+			h.prim	= rays[k].hit.primID;
+			h.u		= rays[k].hit.u;
+			h.v		= rays[k].hit.v;
+			h.t		= rays[k].ray.tfar;
+			h.n		= hiNormal(h.prim, h.u, h.v);
+			flipped[si] = flip;
+			tn[si] = toTangSpace(h.n, s, low_tris[s.tri]);
+			hit[si] = dot(tn[si], {0,0,1}) >= 0;
+		}
+	};
+
+	std::vector<int> active(count);
+	for(int si = 0; si < count; ++si)
+		active[si] = si;
+	trace(active, false);
+
+	// Misses and wrong way hits are shot again in the opposite direction
+	active.clear();
+	for(int si = 0; si < count; ++si)
+		if(!hit[si]) active.push_back(si);
+	if(!active.empty())
+		trace(active, true);
+	bake_rays += count + active.size();
+	BAKE_STAT(stat_retries += active.size());
+	BAKE_STAT(const long long hits_num = std::count(hit.begin(), hit.end(), true));
+	BAKE_STAT(stat_hits += hits_num);
+	BAKE_STAT(stat_misses += count - hits_num);
+
+	// Stage three: scatter in generation order, so every texel sums its samples as the other paths do
+	TiledMap::Tile* tiles[CHANNELS_NUM] = {};
+	for(int si = 0; si < count; ++si)
+		if(hit[si]) accumulate(tiles, tile_min, stream[si], hits[si], tn[si], flipped[si]);
+}
+
+void Core::shootSamples(const Triangle& t, const BakeSample* samples, const int count, const Vec2i& tile_min) {
+	Vec3f	dir[DEF_BLOCK_SIZE];
+	bool	active[DEF_BLOCK_SIZE];
+	bool	hit[DEF_BLOCK_SIZE];
+	bool	retried[DEF_BLOCK_SIZE];
+	HiHit	h[DEF_BLOCK_SIZE];
+	Vec3f	tn[DEF_BLOCK_SIZE];	// Normals in tangent space.
+
+	const auto shoot = [&](BidirHit* bidir) {
+		switch(packet_width) {
+			case 16: shootPacket<RTCRayHit16, 16>(samples, dir, active, count, hit, h, bidir); break;
+			case  8: shootPacket<RTCRayHit8,   8>(samples, dir, active, count, hit, h, bidir); break;
+			case  4: shootPacket<RTCRayHit4,   4>(samples, dir, active, count, hit, h, bidir); break;
+			default:
+				for(int k = 0; k < count; ++k)
+					if(active[k]) hit[k] = shootRay(samples[k].pos, dir[k], h[k], bidir ? bidir + k : nullptr);
+		}
+	};
+
+	// Forward rays along the interpolated normal
+	for(int k = 0; k < count; ++k) {
+		dir[k] = samples[k].dir;
+		active[k] = true;
+	}
+
+	if(bidirectional_rays) {
+		BidirHit bidir[DEF_BLOCK_SIZE];
+		shoot(bidir);
+		int saved{0};
+		for(int k = 0; k < count; ++k) {
+			saved += !bidir[k].fwd_ok;
+			if(hit[k]) tn[k] = toTangSpace(h[k].n, samples[k], t);
+		}
+		bake_rays += count;
+		retries_saved += saved;
+		BAKE_STAT(const int hits_num = std::count(hit, hit + count, true));
+		BAKE_STAT(stat_hits += hits_num);
+		BAKE_STAT(stat_misses += count - hits_num);
+
+		TiledMap::Tile* tiles[CHANNELS_NUM] = {};
+		for(int k = 0; k < count; ++k)
+			if(hit[k]) accumulate(tiles, tile_min, samples[k], h[k], tn[k], false);
+		return;
+	}
+
+	shoot(nullptr);
+
+	// Misses and wrong way hits are shot again in the opposite direction
+	int retries{0};
+	for(int k = 0; k < count; ++k) {
+		bool wrong_way{true};
+		if(hit[k]) {
+			tn[k] = toTangSpace(h[k].n, samples[k], t);
+			wrong_way = dot(tn[k], {0,0,1}) < 0;
+		}
+		active[k] = wrong_way || !hit[k];
+		retried[k] = active[k];
+		dir[k] = -1*samples[k].dir;
+		retries += active[k];
+	}
+	bake_rays += count + retries;
+
+	if(retries > 0) {
+		shoot(nullptr);
+		for(int k = 0; k < count; ++k) {
+			if(!retried[k] || !hit[k]) continue;
+			tn[k] = toTangSpace(h[k].n, samples[k], t);
+			hit[k] = dot(tn[k], {0,0,1}) >= 0;
+		}
+	}
+
+	BAKE_STAT(stat_retries += retries);
+	BAKE_STAT(const int hits_num = std::count(hit, hit + count, true));
+	BAKE_STAT(stat_hits += hits_num);
+	BAKE_STAT(stat_misses += count - hits_num);
+
+	// The tiles are only touched once a sample lands in them
+	TiledMap::Tile* tiles[CHANNELS_NUM] = {};
+	for(int k = 0; k < count; ++k)
+		if(hit[k]) accumulate(tiles, tile_min, samples[k], h[k], tn[k], retried[k]);
+}
+
+void Core::accumulate(	TiledMap::Tile**	tiles,
+						const Vec2i&		tile_min,
+						const BakeSample&	s,
+						const HiHit&		h,
+						const Vec3f&		tn,
+						const bool			backwards) {
+	const int texel = s.texel;
+	const auto add = [&](const BakeChannel c, const Vec3f& v) {
+		TiledMap::Tile*& tile = tiles[c];
+		if(!tile) tile = &channelMap(c).touch(tile_min[0] / DEF_TILE_SIZE, tile_min[1] / DEF_TILE_SIZE);
+		tile->rgb[3*texel + 0] += v[0];
+		tile->rgb[3*texel + 1] += v[1];
+		tile->rgb[3*texel + 2] += v[2];
+		tile->count[texel] += 1;
+	};
+
+	add(CHANNEL_NORMAL, tn);
+
+	// The ray direction is the interpolated low poly normal, possibly reversed
+	const float t = backwards ? -h.t : h.t;
+	if(channels & (1 << CHANNEL_HEIGHT)) {
+		const float d = t*length(s.dir);
+		add(CHANNEL_HEIGHT, {d, d, d});
+	}
+	if(channels & (1 << CHANNEL_WORLD_NORMAL))
+		add(CHANNEL_WORLD_NORMAL, normalize(h.n));
+	if(channels & (1 << CHANNEL_POSITION))
+		add(CHANNEL_POSITION, s.pos + t*s.dir);
+	if(channels & (1 << CHANNEL_CURVATURE)) {
+		const float k = hiCurvature(h.prim);
+		add(CHANNEL_CURVATURE, {k, k, k});
+	}
+	if(channels & (1 << CHANNEL_AO)) {
+		// Every sample gets its own turn of the ray pattern, hashed from its UV
+		uint32_t u_bits, v_bits;
+		std::memcpy(&u_bits, &s.uv[0], sizeof(u_bits));
+		std::memcpy(&v_bits, &s.uv[1], sizeof(v_bits));
+		uint32_t seed = u_bits * 0x9E3779B1u;
+		seed = (seed ^ v_bits) * 0x85EBCA6Bu;
+		seed ^= seed >> 16;
+		const float ao = ambientOcclusion(s.pos + t*s.dir, normalize(h.n), seed);
+		add(CHANNEL_AO, {ao, ao, ao});
+	}
+}
+
+void Core::quantizeMap(unsigned char* out, const int stride) {
+	quantizeChannel(CHANNEL_NORMAL, out, stride);
+}
+
+PostProcessSettings Core::channelSettings(const BakeChannel c, const TiledMap& map) {
+	PostProcessSettings settings{map_dilation, map_blur, threads_num};
+
+	float lo[3], hi[3];
+	switch(c) {
+		case CHANNEL_HEIGHT:
+		case CHANNEL_CURVATURE: {
+			// Zero is mid gray
+			mapRange(map, lo, hi, threads_num);
+			const float m = std::max(std::abs(lo[0]), std::abs(hi[0]));
+			for(int k = 0; k < 3; ++k) {
+				settings.scale[k] = m > 0 ? 127.5f / m : 0;
+				settings.bias[k] = 127.5f;
+				settings.empty[k] = 0;
+			}
+			break;
+		}
+		case CHANNEL_AO:
+			for(int k = 0; k < 3; ++k) {
+				settings.scale[k] = 255;
+				settings.bias[k] = 0;
+				settings.empty[k] = 1;
+			}
+			break;
+		case CHANNEL_POSITION:
+			mapRange(map, lo, hi, threads_num);
+			for(int k = 0; k < 3; ++k) {
+				settings.scale[k] = hi[k] > lo[k] ? 255 / (hi[k] - lo[k]) : 0;
+				settings.bias[k] = -lo[k]*settings.scale[k];
+				settings.empty[k] = lo[k];
+			}
+			break;
+		default:
+			break;
+	}
+	return settings;
+}
+
+void Core::quantizeChannel(const BakeChannel c, unsigned char* out, const int stride) {
+	const PostProcessSettings settings = channelSettings(c, channelMap(c));
+	const auto start = std::chrono::steady_clock::now();
+	postProcessMap(channelMap(c), settings, out, stride);
+	post_process_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+bool Core::writeChannel(	const BakeChannel c, const std::string& filename, const ImageFormat format,
+							ImageEncodeStats* stats, const int udim_tile) {
+	if(c != CHANNEL_NORMAL && !(channels & (1 << c))) {
+		std::cerr << "Channel " << channelName(c) << " was not baked" << std::endl;
+		return false;
+	}
+	const auto start = std::chrono::steady_clock::now();
+
+	// All the UDIM tiles share the encoding of the channel, but every tile is post processed
+	// on its own, so islands are not padded across tiles
+	const TiledMap* source = &channelMap(c);
+	const PostProcessSettings settings = channelSettings(c, *source);
+	if(udim) {
+		const int u = (udim_tile - UDIM_FIRST) % UDIM_COLUMNS, v = (udim_tile - UDIM_FIRST) / UDIM_COLUMNS;
+		if(udim_tile < UDIM_FIRST || (u + 1)*tex_w > source->width() || (v + 1)*tex_h > source->height()) {
+			std::cerr << "UDIM " << udim_tile << " was not baked" << std::endl;
+			return false;
+		}
+		reduce_map.reset(tex_w, tex_h);
+		copyMapRegion(*source, u*tex_w, v*tex_h, reduce_map, threads_num);
+		source = &reduce_map;
+	}
+	const TiledMap& map = *source;
+	const ImageEncodeSettings encode{compression_level, threads_num, bc_quality};
+	const int stride = 3*tex_w;
+	ImageEncodeStats s{};
+	bool ok = false;
+
+	const auto postProcessed = [&]() {
+		post_process_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	};
+	switch(format) {
+		case IMAGE_PNG8: {
+			std::vector<unsigned char> img((size_t)stride*tex_h);
+			postProcessMap(map, settings, img.data(), stride);
+			postProcessed();
+			ok = writePng(filename, img.data(), tex_w, tex_h, stride, encode, &s);
+			break;
+		}
+		case IMAGE_PNG16: {
+			std::vector<uint16_t> img((size_t)stride*tex_h);
+			postProcessMap16(map, settings, img.data(), stride);
+			postProcessed();
+			ok = writePng16(filename, img.data(), tex_w, tex_h, stride, encode, &s);
+			break;
+		}
+		case IMAGE_TIFF_FLOAT: {
+			std::vector<float> img((size_t)stride*tex_h);
+			postProcessMapFloat(map, settings, img.data(), stride);
+			postProcessed();
+			ok = writeTiffFloat(filename, img.data(), tex_w, tex_h, stride, encode, &s);
+			break;
+		}
+		case IMAGE_DDS_BC5: {
+			// Straight from the float values. Normals use the exact v*0.5 + 0.5 mapping of BC5 normal maps.
+			std::vector<float> img((size_t)stride*tex_h);
+			postProcessMapFloat(map, settings, img.data(), stride);
+			const bool unit_vectors = c == CHANNEL_NORMAL || c == CHANNEL_WORLD_NORMAL;
+			parallelForRange(img.size(), 1 << 16, threads_num, [&](const size_t begin, const size_t end) {
+				for(size_t k = begin; k < end; ++k)
+					img[k] = unit_vectors ? img[k]*0.5f + 0.5f : (img[k]*settings.scale[k % 3] + settings.bias[k % 3]) / 255;
+			});
+			postProcessed();
+			ok = writeDdsBc5(filename, img.data(), tex_w, tex_h, stride, unit_vectors, encode, &s);
+			break;
+		}
+	}
+
+	encode_time += s.seconds;
+	encode_raw_bytes += s.raw_bytes;
+	encode_file_bytes += s.file_bytes;
+	if(stats) *stats = s;
+	return ok;
+}
+
+void Core::downsampleMaps() {
+	const auto start = std::chrono::steady_clock::now();
+	for(int c = 0; c < CHANNELS_NUM; ++c) {
+		if(c != CHANNEL_NORMAL && !(channels & (1 << c))) continue;
+		TiledMap& map = channelMap((BakeChannel)c);
+		downsampleMap(map, reduce_map, c == CHANNEL_NORMAL || c == CHANNEL_WORLD_NORMAL, threads_num);
+		map.swap(reduce_map);
+	}
+	// The maps of the channels not baked are empty. UDIM tiles stay aligned on even sizes.
+	tex_w = (tex_w + 1) / 2;
+	tex_h = (tex_h + 1) / 2;
+	post_process_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+const char* Core::channelName(const BakeChannel c) {
+	switch(c) {
+		case CHANNEL_NORMAL:		return "normal";
+		case CHANNEL_HEIGHT:		return "height";
+		case CHANNEL_WORLD_NORMAL:	return "world_normal";
+		case CHANNEL_POSITION:		return "position";
+		case CHANNEL_CURVATURE:		return "curvature";
+		case CHANNEL_AO:			return "ao";
+		default:					return "";
+	}
+}
+
+void Core::previewMap(unsigned char* out, const int stride) const {
 	for(int j = 0; j < tex_h; ++j) {
+		unsigned char* row = out + (size_t)(tex_h - j - 1)*stride;
 		for(int i = 0; i < tex_w; ++i) {
-			const int count = pix_count[i + j*tex_w];
-			if(count > 0) {
-				tex[3*(i + j*tex_w) + 0] /= count;
-				tex[3*(i + j*tex_w) + 1] /= count;
-				tex[3*(i + j*tex_w) + 2] /= count;
-			} else {
-				tex[3*(i + j*tex_w) + 0] = 0;
-				tex[3*(i + j*tex_w) + 1] = 0;
-				tex[3*(i + j*tex_w) + 2] = 1;
+			Vec3f n{0, 0, 1};
+			const TiledMap::Tile* tile = tex.tile(i / DEF_TILE_SIZE, j / DEF_TILE_SIZE);
+			if(tile) {
+				const int k = i % DEF_TILE_SIZE + (j % DEF_TILE_SIZE)*DEF_TILE_SIZE;
+				if(tile->count[k] > 0)
+					n = (1.0f / tile->count[k]) * Vec3f{tile->rgb[3*k + 0], tile->rgb[3*k + 1], tile->rgb[3*k + 2]};
 			}
+			row[3*i + 0] = 128 * n[0] + 127;
+			row[3*i + 1] = 128 * n[1] + 127;
+			row[3*i + 2] = 128 * n[2] + 127;
 		}
 	}
 }
 
 const int Core::getLowTrisNum() {
-	return low_shape.mesh.indices.size() / 3;
+	return low_mesh.trinum;
 }
 
 
 Triangle Triangle::fromIndex(	const int ti,
-								const tinyobj::shape_t& shape,
-								const tinyobj::attrib_t& att) {
-
-	const int vidx0 =	shape.mesh.indices[ti*3 + 0].vertex_index;
-	const int vidx1 =	shape.mesh.indices[ti*3 + 1].vertex_index;
-	const int vidx2 =	shape.mesh.indices[ti*3 + 2].vertex_index;
-	const int nidx0 = 	shape.mesh.indices[ti*3 + 0].normal_index;
-	const int nidx1 = 	shape.mesh.indices[ti*3 + 1].normal_index;
-	const int nidx2 = 	shape.mesh.indices[ti*3 + 2].normal_index;
-	const int idx0 =	shape.mesh.indices[ti*3 + 0].texcoord_index;
-	const int idx1 =	shape.mesh.indices[ti*3 + 1].texcoord_index;
-	const int idx2 =	shape.mesh.indices[ti*3 + 2].texcoord_index;
+								const Mesh& mesh,
+								const std::vector<Vec3f>& tangents,
+								const std::vector<float>& signs) {
+
+	const uint32_t* vidx =	mesh.pos_idx + ti*3;
+	const uint32_t* nidx =	mesh.nrm_idx + ti*3;
+	const uint32_t* idx =	mesh.uv_idx  + ti*3;
 	return {
-		{att.vertices[3*vidx0 + 0],
-		 att.vertices[3*vidx0 + 1],
-		 att.vertices[3*vidx0 + 2]},
-		{att.vertices[3*vidx1 + 0],
-		 att.vertices[3*vidx1 + 1],
-		 att.vertices[3*vidx1 + 2]},
-		{att.vertices[3*vidx2 + 0],
-		 att.vertices[3*vidx2 + 1],
-		 att.vertices[3*vidx2 + 2]},
-		{att.normals[3*nidx0 + 0],
-		 att.normals[3*nidx0 + 1],
-		 att.normals[3*nidx0 + 2]},
-		{att.normals[3*nidx1 + 0],
-		 att.normals[3*nidx1 + 1],
-		 att.normals[3*nidx1 + 2]},
-		{att.normals[3*nidx2 + 0],
-		 att.normals[3*nidx2 + 1],
-		 att.normals[3*nidx2 + 2]},
-		{att.texcoords[idx0*2 + 0],
-		 att.texcoords[idx0*2 + 1]},
-		{att.texcoords[idx1*2 + 0],
-		 att.texcoords[idx1*2 + 1]},
-		{att.texcoords[idx2*2 + 0],
-		 att.texcoords[idx2*2 + 1]}
+		mesh.position(vidx[0]),
+		mesh.position(vidx[1]),
+		mesh.position(vidx[2]),
+		mesh.normal(nidx[0]),
+		mesh.normal(nidx[1]),
+		mesh.normal(nidx[2]),
+		mesh.texcoord(idx[0]),
+		mesh.texcoord(idx[1]),
+		mesh.texcoord(idx[2]),
+		tangents[ti*3 + 0],
+		tangents[ti*3 + 1],
+		tangents[ti*3 + 2],
+		signs[ti]
 	};
 };
 
 
-bool Core::shootRay(const Vec3f& pos, const Vec3f& dir, Vec3f& n) {
+bool Core::shootRay(const Vec3f& pos, const Vec3f& dir, HiHit& h, BidirHit* bidir) {
+	// The context is per call so that the bake threads do not share it
+	BidirContext bctx;
+	RTCIntersectContext& context = bctx.context;
+	rtcInitIntersectContext(&context);
+
+	const float back = bidir ? ray_back_distance : 0;
+	if(bidir) {
+		context.filter = bidirFilter;
+		bctx.core = this;
+		bctx.back = back;
+		bctx.hits = bidir;
+		bidir->dist = bidir->fwd_t = std::numeric_limits<float>::infinity();
+		bidir->fwd_ok = false;
+	}
+
 	RTCRayHit rayhit;
 
-	rayhit.ray.org_x = pos[0];
-	rayhit.ray.org_y = pos[1];
-	rayhit.ray.org_z = pos[2];
+	rayhit.ray.org_x = pos[0] - back*dir[0];
+	rayhit.ray.org_y = pos[1] - back*dir[1];
+	rayhit.ray.org_z = pos[2] - back*dir[2];
 	rayhit.ray.dir_x = dir[0];
 	rayhit.ray.dir_y = dir[1];
 	rayhit.ray.dir_z = dir[2];
 	rayhit.ray.flags = 0;
+	rayhit.ray.id = 0;
 	rayhit.ray.tnear = 0;
-	rayhit.ray.tfar = 1;
+	rayhit.ray.tfar = bidir ? back + ray_front_distance : 1;
 	rayhit.hit.geomID = RTC_INVALID_GEOMETRY_ID;
 
-	rtcIntersect1(hi_embree_scene, &hi_embree_context, &rayhit);
+	rtcIntersect1(hi_embree_scene, &context, &rayhit);
+
+	if(bidir) {
+		h = bidir->best;
+		return bidir->dist != std::numeric_limits<float>::infinity();
+	}
+
+	const bool hit{rayhit.hit.geomID != RTC_INVALID_GEOMETRY_ID};
+	if(hit) {
+		h.prim	= rayhit.hit.primID;
+		h.u		= rayhit.hit.u;
+		h.v		= rayhit.hit.v;
+		h.t		= rayhit.ray.tfar;
+		h.n		= hiNormal(h.prim, h.u, h.v);
+	}
+
+	return hit;
+}
+
+void Core::bidirFilter(const RTCFilterFunctionNArguments* args) {
+	const BidirContext* bctx = reinterpret_cast<const BidirContext*>(args->context);
+	const unsigned N = args->N;
+	for(unsigned i = 0; i < N; ++i) {
+		if(args->valid[i] == 0) continue;
+		// Rejecting every hit makes Embree report all of them along the ray
+		args->valid[i] = 0;
+
+		BidirHit& b = bctx->hits[RTCRayN_id(args->ray, N, i)];
+		HiHit h;
+		h.prim	= RTCHitN_primID(args->hit, N, i);
+		h.u		= RTCHitN_u(args->hit, N, i);
+		h.v		= RTCHitN_v(args->hit, N, i);
+		h.t		= RTCRayN_tfar(args->ray, N, i) - bctx->back;
+		h.n		= bctx->core->hiNormal(h.prim, h.u, h.v);
+		const Vec3f dir{RTCRayN_dir_x(args->ray, N, i), RTCRayN_dir_y(args->ray, N, i), RTCRayN_dir_z(args->ray, N, i)};
+		const bool right_way = dot(h.n, dir) >= 0;
+
+		if(h.t >= 0 && h.t < b.fwd_t) {
+			b.fwd_t = h.t;
+			b.fwd_ok = right_way;
+		}
+		if(right_way && std::abs(h.t) < b.dist) {
+			b.dist = std::abs(h.t);
+			b.best = h;
+		}
+	}
+}
+
+static inline void intersectN(const int* valid, RTCScene scene, RTCIntersectContext* context, RTCRayHit4* rh)  { rtcIntersect4 (valid, scene, context, rh); }
+static inline void intersectN(const int* valid, RTCScene scene, RTCIntersectContext* context, RTCRayHit8* rh)  { rtcIntersect8 (valid, scene, context, rh); }
+static inline void intersectN(const int* valid, RTCScene scene, RTCIntersectContext* context, RTCRayHit16* rh) { rtcIntersect16(valid, scene, context, rh); }
+
+template<typename RayHitN, int N>
+void Core::shootPacket(	const BakeSample*	samples,
+						const Vec3f*		dirs,
+						const bool*			active,
+						const int			count,
+						bool*				hit,
+						HiHit*				h,
+						BidirHit*			bidir) {
+
+	BidirContext bctx;
+	RTCIntersectContext& context = bctx.context;
+	rtcInitIntersectContext(&context);
+	context.flags = RTC_INTERSECT_CONTEXT_FLAG_COHERENT;
+
+	const float back = bidir ? ray_back_distance : 0;
+	const float tfar = bidir ? back + ray_front_distance : 1;
+	if(bidir) {
+		context.filter = bidirFilter;
+		bctx.core = this;
+		bctx.back = back;
+		bctx.hits = bidir;
+	}
+
+	for(int first = 0; first < count; first += N) {
+		RayHitN rayhit;
+		// Embree wants the mask aligned like the packet
+		alignas(4*N) int valid[N];
+		bool any_valid{false};
+
+		for(int k = 0; k < N; ++k) {
+			const int si = first + k;
+			valid[k] = si < count && active[si] ? -1 : 0;
+			any_valid |= valid[k] != 0;
+			if(!valid[k]) continue;
+
+			rayhit.ray.org_x[k] = samples[si].pos[0] - back*dirs[si][0];
+			rayhit.ray.org_y[k] = samples[si].pos[1] - back*dirs[si][1];
+			rayhit.ray.org_z[k] = samples[si].pos[2] - back*dirs[si][2];
+			rayhit.ray.dir_x[k] = dirs[si][0];
+			rayhit.ray.dir_y[k] = dirs[si][1];
+			rayhit.ray.dir_z[k] = dirs[si][2];
+			rayhit.ray.flags[k] = 0;
+			rayhit.ray.mask[k]	= 0xFFFFFFFF;
+			rayhit.ray.id[k]	= si;
+			rayhit.ray.time[k]	= 0;
+			rayhit.ray.tnear[k] = 0;
+			rayhit.ray.tfar[k]	= tfar;
+			rayhit.hit.geomID[k] = RTC_INVALID_GEOMETRY_ID;
+			if(bidir) {
+				bidir[si].dist = bidir[si].fwd_t = std::numeric_limits<float>::infinity();
+				bidir[si].fwd_ok = false;
+			}
+		}
+		if(!any_valid) continue;
+
+		intersectN(valid, hi_embree_scene, &context, &rayhit);
+
+		for(int k = 0; k < N; ++k) {
+			if(!valid[k]) continue;
+			const int si = first + k;
+			if(bidir) {
+				hit[si] = bidir[si].dist != std::numeric_limits<float>::infinity();
+				h[si] = bidir[si].best;
+				continue;
+			}
+			hit[si] = rayhit.hit.geomID[k] != RTC_INVALID_GEOMETRY_ID;
+			if(!hit[si]) continue;
+			h[si].prim	= rayhit.hit.primID[k];
+			h[si].u		= rayhit.hit.u[k];
+			h[si].v		= rayhit.hit.v[k];
+			h[si].t		= rayhit.ray.tfar[k];
+			h[si].n		= hiNormal(h[si].prim, h[si].u, h[si].v);
+		}
+	}
+}
 
-	const uint  id{rayhit.hit.primID};
-	const float a1{rayhit.hit.u};
-	const float a2{rayhit.hit.v};
+static inline void occludedN(const int* valid, RTCScene scene, RTCIntersectContext* context, RTCRay4* r)  { rtcOccluded4 (valid, scene, context, r); }
+static inline void occludedN(const int* valid, RTCScene scene, RTCIntersectContext* context, RTCRay8* r)  { rtcOccluded8 (valid, scene, context, r); }
+static inline void occludedN(const int* valid, RTCScene scene, RTCIntersectContext* context, RTCRay16* r) { rtcOccluded16(valid, scene, context, r); }
+
+float Core::ambientOcclusion(const Vec3f& pos, const Vec3f& n, const uint32_t seed) {
+	// Occlusion rays are always traced in packets, Embree emulates them without native support
+	switch(packet_width) {
+		case 16:	return ambientOcclusionN<RTCRay16, 16>(pos, n, seed);
+		case 8:		return ambientOcclusionN<RTCRay8,   8>(pos, n, seed);
+		default:	return ambientOcclusionN<RTCRay4,   4>(pos, n, seed);
+	}
+}
+
+template<typename RayN, int N>
+float Core::ambientOcclusionN(const Vec3f& pos, const Vec3f& n, const uint32_t seed) {
+	RTCIntersectContext context;
+	rtcInitIntersectContext(&context);
+
+	// Frame around n (Duff et al.), turned by the seed
+	const float sign = std::copysign(1.0f, n[2]);
+	const float a = -1 / (sign + n[2]);
+	const float b = n[0]*n[1]*a;
+	const Vec3f t0{1 + sign*n[0]*n[0]*a, sign*b, -sign*n[0]};
+	const Vec3f b0{b, sign + n[1]*n[1]*a, -n[1]};
+	const float angle = seed * (2*PI / 4294967296.0f);
+	const Vec3f tang = std::cos(angle)*t0 + std::sin(angle)*b0;
+	const Vec3f bitang = cross(n, tang);
+
+	RayN ray;
+	for(int k = 0; k < N; ++k) {
+		ray.org_x[k]	= pos[0];
+		ray.org_y[k]	= pos[1];
+		ray.org_z[k]	= pos[2];
+		ray.tnear[k]	= ao_bias*hi_extent;
+		ray.time[k]		= 0;
+		ray.mask[k]		= 0xFFFFFFFF;
+		ray.flags[k]	= 0;
+	}
+
+	const __m128 far = _mm_set1_ps(ao_max_distance > 0 ? ao_max_distance : std::numeric_limits<float>::infinity());
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 tx = _mm_set1_ps(tang[0]),		ty = _mm_set1_ps(tang[1]),		tz = _mm_set1_ps(tang[2]);
+	const __m128 bx = _mm_set1_ps(bitang[0]),	by = _mm_set1_ps(bitang[1]),	bz = _mm_set1_ps(bitang[2]);
+	const __m128 nx = _mm_set1_ps(n[0]),		ny = _mm_set1_ps(n[1]),			nz = _mm_set1_ps(n[2]);
+	static const int bits[16] = {0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4};
+
+	const int rays = std::max(ao_rays, 1);
+	const float tol2 = ao_tolerance*ao_tolerance;
+	int traced = 0, occluded = 0;
+	while(traced < rays) {
+		alignas(4*N) int valid[N];
+		for(int k = 0; k < N; ++k)
+			valid[k] = traced + k < rays ? -1 : 0;
+
+		// Local directions into the frame, 4 rays at a time
+		for(int k = 0; k < N; k += 4) {
+			const float* d = ao_dirs.data() + traced + k;
+			const __m128 x = _mm_loadu_ps(d);
+			const __m128 y = _mm_loadu_ps(d + ao_dirs_stride);
+			const __m128 z = _mm_loadu_ps(d + 2*ao_dirs_stride);
+			_mm_store_ps(ray.dir_x + k, _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, tx), _mm_mul_ps(y, bx)), _mm_mul_ps(z, nx)));
+			_mm_store_ps(ray.dir_y + k, _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, ty), _mm_mul_ps(y, by)), _mm_mul_ps(z, ny)));
+			_mm_store_ps(ray.dir_z + k, _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, tz), _mm_mul_ps(y, bz)), _mm_mul_ps(z, nz)));
+			_mm_store_ps(ray.tfar + k, far);
+		}
+
+		occludedN(valid, hi_embree_scene, &context, &ray);
+
+		// Embree sets tfar to -inf on occluded rays
+		for(int k = 0; k < N; k += 4) {
+			const int lanes = _mm_movemask_ps(_mm_cmplt_ps(_mm_load_ps(ray.tfar + k), zero)) &
+							_mm_movemask_ps(_mm_castsi128_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(valid + k))));
+			occluded += bits[lanes];
+		}
+		traced = std::min(traced + N, rays);
+
+		// Binomial standard error of the estimate
+		if(ao_tolerance > 0 && traced >= AO_MIN_RAYS) {
+			const float p = (float)occluded / traced;
+			if(p*(1 - p) <= tol2*traced) break;
+		}
+	}
+
+	bake_rays += traced;
+	return 1 - (float)occluded / traced;
+}
+
+Vec3f Core::hiNormal(const uint id, const float a1, const float a2) {
 	const float a0{1 - a1 - a2};
 
-	const int n0_idx{hi_shape.mesh.indices[id*3 + 0].normal_index};
-	const int n1_idx{hi_shape.mesh.indices[id*3 + 1].normal_index};
-	const int n2_idx{hi_shape.mesh.indices[id*3 + 2].normal_index};
-	const Vec3f n0{	hi_attrib.normals[n0_idx*3 + 0],
-					hi_attrib.normals[n0_idx*3 + 1],
-					hi_attrib.normals[n0_idx*3 + 2]};
-	const Vec3f n1{	hi_attrib.normals[n1_idx*3 + 0],
-					hi_attrib.normals[n1_idx*3 + 1],
-					hi_attrib.normals[n1_idx*3 + 2]};
-	const Vec3f n2{	hi_attrib.normals[n2_idx*3 + 0],
-					hi_attrib.normals[n2_idx*3 + 1],
-					hi_attrib.normals[n2_idx*3 + 2]};
-
-	n = {a0*n0 + a1*n1 + a2*n2};
-
-	return rayhit.hit.geomID != RTC_INVALID_GEOMETRY_ID; 
-}
-
-Vec3f Core::toTangSpace(const Vec3f&	hi_n,
-						const Vec3f&	low_p, 
-						const Vec3f&	low_n,
-						const Vec2f&	uv,
-						const Triangle&	t) {
-
-	// Get point on +u
-	const Vec2f new_uv	{uv[0] + 0.01, uv[1]};
-	const float t_area	{triarea( t.uv0,  t.uv1,  t.uv2)};
-	const float a		{triarea(new_uv,  t.uv1,  t.uv2) / t_area};
-	const float b		{triarea( t.uv0, new_uv,  t.uv2) / t_area};
-	const float c		{triarea( t.uv0,  t.uv1, new_uv) / t_area};
-	const Vec3f new_p	{a*t.p0 + b*t.p1 + c*t.p2};
-	const Vec3f tmp_tang{new_p - low_p};
-	// Build tangent space to world space reference frame
-	const Vec3f bitang	{normalize(cross(low_n, tmp_tang))};
-	const Vec3f tang	{cross(bitang, low_n)};
-	const Mat4  mat		{tang, bitang, low_n, {}};
+	const uint32_t* nidx = hi_nrm_idx + id*3;
+	return {a0*hiVertexNormal(nidx[0]) +
+			a1*hiVertexNormal(nidx[1]) +
+			a2*hiVertexNormal(nidx[2])};
+}
 
-	// Hi poly normal into tangent space of low poly model
-	return {transformVector(transpose(mat), hi_n)};
+Vec3f Core::hiVertexNormal(const uint32_t ni) {
+	if(!hi_oct_normals.empty())
+		return octDecode(hi_oct_normals[ni]);
+	return hi_mesh.normal(ni);
+}
+
+float Core::hiCurvature(const uint id) {
+	// Average over the edges of the normal curvature along the edge, (dn . dp) / |dp|^2.
+	// It is 1/r on a sphere of radius r.
+	Vec3f p[3], n[3];
+	for(int k = 0; k < 3; ++k) {
+		const uint32_t vi = hi_pos_idx[3*id + k];
+		p[k] = {hi_pos[3*vi + 0], hi_pos[3*vi + 1], hi_pos[3*vi + 2]};
+		n[k] = normalize(hiVertexNormal(hi_nrm_idx[3*id + k]));
+	}
+
+	float k_sum = 0;
+	for(int e = 0; e < 3; ++e) {
+		const Vec3f dp = p[(e + 1) % 3] - p[e];
+		const float len2 = dot(dp, dp);
+		if(len2 > 0) k_sum += dot(n[(e + 1) % 3] - n[e], dp) / len2;
+	}
+	return k_sum / 3;
+}
+
+int Core::choosePacketWidth() {
+	if(packet_size == 1 || packet_size == 4 || packet_size == 8 || packet_size == 16)
+		return packet_size;
+
+	// Widest packet that both this Embree build and the CPU run natively
+	const bool ray16 = rtcGetDeviceProperty(hi_embree_device, RTC_DEVICE_PROPERTY_NATIVE_RAY16_SUPPORTED);
+	const bool ray8  = rtcGetDeviceProperty(hi_embree_device, RTC_DEVICE_PROPERTY_NATIVE_RAY8_SUPPORTED);
+	const bool ray4  = rtcGetDeviceProperty(hi_embree_device, RTC_DEVICE_PROPERTY_NATIVE_RAY4_SUPPORTED);
+	#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+		if(ray16 && __builtin_cpu_supports("avx512f"))	return 16;
+		if(ray8  && __builtin_cpu_supports("avx"))		return 8;
+	#else
+		if(ray16)	return 16;
+		if(ray8)	return 8;
+	#endif
+	if(ray4) return 4;
+	return 1;
+}
 
+Vec3f Core::toTangSpace(const Vec3f&		hi_n,
+						const BakeSample&	s,
+						const Triangle&		t) {
+
+	// Per pixel MikkTSpace frame: interpolated normal and tangent, tangent
+	// orthogonalized against the normal, bitangent rebuilt with the sign.
+	const Vec3f n		{normalize(s.dir)};
+	const Vec3f tang	{normalize(s.tang - dot(n, s.tang)*n)};
+	const Vec3f bitang	{t.sign*cross(n, tang)};
+
+	// Hi poly normal into tangent space of low poly model
+	return {dot(hi_n, tang), dot(hi_n, bitang), dot(hi_n, n)};
 }
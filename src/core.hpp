@@ -7,79 +7,376 @@
 
 #include "tiny_obj_loader.h"
 
+#include <atomic>
+#include <functional>
 #include <iostream>
-
+#include <memory>
+#include <thread>
+#include <vector>
 
 #include <xmmintrin.h>
 #include <pmmintrin.h>
 #include <embree3/rtcore.h>
 
-// For QImage
-#include <QWidget>
-
+#include "bakeStats.hpp"
+#include "image.hpp"
 #include "math.hpp"
+#include "mesh.hpp"
+#include "postProcess.hpp"
+#include "tiledMap.hpp"
 
 #define DEF_TEX_SIZE 2048
 
 // The square root of the number of samples
 #define DEF_SPP_SIDE 2
 
+// Side in texels of the square tiles the map is split into when baking in parallel.
+// Bake tiles are the map tiles, so a bake thread owns every texel it writes.
+#define DEF_TILE_SIZE MAP_TILE_SIZE
+
+// Max number of samples traced together. Must be a multiple of 16.
+#define DEF_BLOCK_SIZE 32
+
+// Origin cells per axis used to bin the rays of a stream bake
+#define DEF_STREAM_CELLS 4
+
+// Ambient occlusion rays per sample, and the rays traced before a sample may stop early
+#define DEF_AO_RAYS 64
+#define AO_MIN_RAYS 16
+
+// UDIM numbering: tile (u, v) is UDIM_FIRST + u + UDIM_COLUMNS*v
+#define UDIM_FIRST 1001
+#define UDIM_COLUMNS 10
+// Rows of the UDIM range, tiles 1001 to 2000
+#define UDIM_ROWS 100
+
+enum BakeMode {
+	// Samples are traced in packets as soon as a block of them is ready
+	BAKE_MODE_PACKET,
+	// All the samples of a tile are generated first, sorted by coherence and traced as a stream
+	BAKE_MODE_STREAM
+};
+
+// Maps baked by generateNormalMap
+enum BakeChannel {
+	CHANNEL_NORMAL,			// Tangent space normal, always baked
+	CHANNEL_HEIGHT,			// Signed distance from the low to the high poly surface along the low poly normal
+	CHANNEL_WORLD_NORMAL,	// High poly normal in object space
+	CHANNEL_POSITION,		// Object space position of the high poly surface
+	CHANNEL_CURVATURE,		// Mean curvature of the high poly surface, positive where convex
+	CHANNEL_AO,				// Ambient occlusion of the high poly surface, 1 where fully open
+	CHANNELS_NUM
+};
+
+// A ray hit on the high poly surface
+struct HiHit {
+	Vec3f		n;		// Interpolated shading normal
+	float		t;		// Ray distance, in units of the ray direction
+	uint32_t	prim;
+	float		u, v;	// Barycentrics of the second and third vertex
+};
+
+// Hits of a bidirectional ray, collected by its intersection filter
+struct BidirHit {
+	HiHit	best;		// Right way hit nearest to the low poly surface, t signed
+	float	dist;		// |best.t|, infinity if there is none
+	float	fwd_t;		// Nearest hit in front of the surface
+	bool	fwd_ok;		// That hit faces the right way, so a forward ray alone would have done
+};
+
 class Triangle {
 public:
 	static Triangle fromIndex(	const int ti,
-								const tinyobj::shape_t& shape,
-								const tinyobj::attrib_t& att);
+								const Mesh& mesh,
+								const std::vector<Vec3f>& tangents,
+								const std::vector<float>& signs);
 
 	const Vec3f p0,		p1,		p2;
 	const Vec3f n0,		n1,		n2;
 	const Vec2f uv0,	uv1,	uv2;
+	const Vec3f t0,		t1,		t2;	// Per vertex tangents
+	const float	sign;				// Bitangent sign, -1 on mirrored UVs
+};
+
+// A point on the low poly surface to shoot a ray from
+struct BakeSample {
+	Vec3f	pos;
+	Vec3f	dir;
+	Vec3f	tang;
+	Vec2f	uv;
+	int		texel;	// Index of the texel in its map tile
+	int		tri;	// Index of the source triangle (stream bake only)
+};
+
+// Snapshot of the progress of a bake
+struct BakeProgress {
+	long long	work_done;		// Triangle and tile pairs rasterized
+	long long	work_total;
+	long long	rays;			// Rays traced so far
+	double		elapsed;		// Seconds since the bake started
+	double		eta;			// Estimated seconds left, negative until some work is done
 };
 
-// TODO: Make indipendent from QImage
 class Core {
 public:
 	Core();
 	~Core();
 
-	void loadLowObj	(std::string filename);
-	void loadHighObj(std::string filename);
+	bool loadLowObj	(std::string filename);
+	bool loadHighObj(std::string filename);
 
 	void clearBuffers();
-	void generateNormalMapOnTriangle(const int ti);
-	void generateNormalMap();
-	void divideMapByCount();
+	// Frees the maps and their pooled tiles, keeping the meshes and the BVH
+	void releaseBuffers();
+	void generateNormalMapOnTriangle(const int ti, const Vec2i& tile_min, const Vec2i& tile_max);
+	void generateNormalMapStream(const std::vector<int>& tris, const Vec2i& tile_min, const Vec2i& tile_max);
+	// Returns false if the bake was cancelled
+	bool generateNormalMap();
+
+	// Runs generateNormalMap on a bake thread and returns at once. on_done is called
+	// on that thread with the result of generateNormalMap. The meshes and settings
+	// must not change until it is called.
+	void startNormalMap(const std::function<void(bool)>& on_done);
+	// Asks the running bake to stop after the triangle it is on. Does not wait. Called before
+	// startNormalMap, it stops the next bake as soon as it starts. waitBake clears it once
+	// the bake it stopped has ended.
+	void cancelBake();
+	// Waits for the bake thread started by startNormalMap
+	void waitBake();
+	// Can be called from any thread while baking
+	BakeProgress bakeProgress() const;
+	// Statistics of the last loads, bake and output. Built with BAKE_STATS=0, hits, misses,
+	// retries and degenerate_tris are 0 and there are no per triangle times.
+	BakeStats bakeStats() const;
+
+	// Averages, pads, blurs and writes the map as 8 bit RGB, top row first
+	void quantizeMap(unsigned char* out, const int stride);
+	// Same for any channel. Normals keep the usual encoding, heights and curvatures
+	// are scaled to their largest magnitude around mid gray and positions to their bounding box.
+	void quantizeChannel(const BakeChannel c, unsigned char* out, const int stride);
+	// Post processes a channel straight into the pixel type of format and encodes it on
+	// threads_num threads. PNGs use the quantizeChannel encoding, TIFFs keep the raw values
+	// and DDS files store the first two components with mips. A UDIM bake writes the tex_w x tex_h
+	// map of UDIM udim_tile, any other bake ignores it.
+	bool writeChannel(	const BakeChannel c, const std::string& filename, const ImageFormat format,
+						ImageEncodeStats* stats = nullptr, const int udim_tile = UDIM_FIRST);
+
+	// Halves the baked maps and tex_w, tex_h, rounding up. Every texel becomes the sample
+	// weighted average of the 2x2 texels under it, renormalized for normals. Writing the
+	// channels after every call gives a pyramid of sizes from a single bake.
+	void downsampleMaps();
 
 	int tex_w, tex_h;
-	std::vector<float> tex;
+
+	// Accumulated tangent space normals and sample counts
+	TiledMap tex;
+
+	// UDIM bake: every UDIM tile the low poly UVs cover gets a tex_w x tex_h map of its own, all
+	// baked in one pass. The maps are laid side by side, as UV space is, so tiles of them are
+	// only allocated where samples land. Otherwise UVs outside [0, 1) are clipped away.
+	bool udim;
+	// UDIMs the low poly UVs cover, found by clearBuffers. Just UDIM_FIRST without udim.
+	std::vector<int> udim_tiles;
+
+	// Bit mask of the channels to bake, 1 << BakeChannel. They share the rays of the normal map.
+	unsigned channels;
+
+	// Accumulators of a channel. CHANNEL_NORMAL is tex.
+	TiledMap& channelMap(const BakeChannel c) { return c == CHANNEL_NORMAL ? tex : aux_maps[c - 1]; }
+	static const char* channelName(const BakeChannel c);
+
+	// Ambient occlusion, traced from the high poly hit of every sample over the cosine weighted
+	// hemisphere of its normal. A sample stops once the standard error of its estimate falls
+	// below ao_tolerance, 0 traces all ao_rays.
+	int		ao_rays;
+	float	ao_max_distance;	// Occluders farther away are ignored, 0 for no limit
+	float	ao_bias;			// Ray offset from the surface, relative to the size of the high poly mesh
+	float	ao_tolerance;
+
+	// Output stage settings
+	int		map_dilation;	// Pixels the UV islands are padded by
+	bool	map_blur;		// 3x3 tent filter
+	int		compression_level;	// zlib level of the written files
+	BcQuality	bc_quality;		// Effort of the DDS block encoder
+
+	// Square root of the number of samples per texel
+	int spp_side;
+
+	// Load meshes from, and save them to, binary caches next to the OBJ files
+	bool use_mesh_cache;
+
+	// Parse OBJs with the multithreaded loader instead of tinyobj
+	bool use_parallel_obj_loader;
+
+	// Weighting of the vertex normals generated for meshes without normals
+	NormalWeighting normal_weighting;
+
+	// High poly BVH settings, applied on the next loadHighObj.
+	// With embree_own_buffers Embree allocates the vertex and index buffers and the
+	// mesh copies are freed. Otherwise Embree shares the mesh arrays, which costs
+	// nothing extra when they are a mapped cache file.
+	bool			embree_own_buffers;
+	bool			embree_compact;			// RTC_SCENE_FLAG_COMPACT
+	RTCBuildQuality	embree_build_quality;
+	// Keeps the high poly shading normals octahedral encoded in 32 bits instead of 96
+	bool			hi_normals_low_precision;
+
+	// Stats of the last high poly BVH build
+	double			bvh_build_time;		// Seconds
+	size_t			bvh_bytes;			// Memory allocated by Embree
+
+	// Number of bake threads. 0 means one per hardware thread.
+	int threads_num;
+
+	// Rays per Embree packet: 1, 4, 8 or 16. 0 picks the widest the CPU supports.
+	int packet_size;
+
+	BakeMode bake_mode;
+
+	// Progressive bake: pass k traces the k-th sub-sample of every texel, in a stratified order,
+	// into the same accumulators, so the map is usable after the first pass. A bake cancelled
+	// after a complete pass still succeeds with the samples traced so far.
+	bool progressive;
+	// Called on the bake thread after every progressive pass, with the bake threads idle
+	std::function<void(int passes_done, int passes_total)> on_pass;
+
+	// Bidirectional rays: every sample traces a single ray starting ray_back_distance behind the
+	// low poly surface and ending ray_front_distance in front of it, both in units of the
+	// interpolated normal, and keeps the right way hit nearest to the surface. Otherwise a
+	// forward ray is traced and misses and wrong way hits are traced again backwards.
+	// Packet bakes only, stream bakes always trace two rays.
+	bool	bidirectional_rays;
+	float	ray_front_distance;
+	float	ray_back_distance;
+
+	// Adaptive sampling, in the progressive pass order: the first adaptive_initial_samples
+	// passes trace every texel, the next ones only the texels whose normals still spread
+	// more than adaptive_threshold degrees from their mean, up to spp_side^2 samples.
+	bool	adaptive;
+	int		adaptive_initial_samples;
+	float	adaptive_threshold;
+
+	// Samples traced by the last bake per texel with at least one hit
+	double	average_spp;
+
+	// Writes the current average of the accumulators as 8 bit RGB, top row first.
+	// Safe to call from on_pass.
+	void previewMap(unsigned char* out, const int stride) const;
+
+	// Rasterizer counters of the last bake
+	std::atomic<long long> texels_visited;
+	std::atomic<long long> texels_covered;
+	// Backward rays the bidirectional rays of the last bake made unnecessary
+	std::atomic<long long> retries_saved;
 
 	const int getLowTrisNum();
 
 private:
 
-	tinyobj::attrib_t	low_attrib;
-	tinyobj::shape_t	low_shape;
+	std::thread				bake_thread;
+	std::atomic<bool>		bake_cancel;
+	std::atomic<long long>	bake_work_done;
+	std::atomic<long long>	bake_work_total;
+	std::atomic<long long>	bake_rays;
+	std::atomic<long long>	bake_samples;
+	std::atomic<long long>	bake_start;		// steady_clock ticks
+
+	// Statistics counters, added to in bulk by every triangle or block
+	std::atomic<long long>	stat_hits;
+	std::atomic<long long>	stat_misses;
+	std::atomic<long long>	stat_retries;
+	long long				stat_degenerate_tris;
+	std::unique_ptr<std::atomic<long long>[]>	stat_tri_ns;	// Bake time per low poly triangle
+	double					load_low_time;
+	double					load_high_time;
+	double					bake_time;
+	double					post_process_time;
+	double					encode_time;
+	long long				encode_raw_bytes;
+	long long				encode_file_bytes;
+
+	// Output encoding of a channel, some of which depend on its range
+	PostProcessSettings channelSettings(const BakeChannel c, const TiledMap& map);
 
-	tinyobj::attrib_t	hi_attrib;
-	tinyobj::shape_t	hi_shape;
+	Mesh					low_mesh;
+	std::vector<Triangle>	low_tris;
+	std::vector<bool>		udim_skipped;	// Low poly triangles outside the UDIM range, set by clearBuffers
+
+	TiledMap				aux_maps[CHANNELS_NUM - 1];
+	TiledMap				reduce_map;		// Scratch of downsampleMaps and writeChannel, its pool keeps the tiles
+
+	Mesh				hi_mesh;
+	const float*		hi_pos;			// Positions and their indices, may point into Embree buffers
+	const uint32_t*		hi_pos_idx;
+	const uint32_t*		hi_nrm_idx;		// Normal indices, may point into an Embree buffer
+	std::vector<uint32_t> hi_oct_normals;	// Encoded normals in low precision mode
 
 	RTCScene			hi_embree_scene;
 	RTCDevice			hi_embree_device;
-	RTCIntersectContext hi_embree_context;
+	std::atomic<long long> hi_embree_bytes;
+	float				hi_extent;		// Diagonal of the high poly bounding box
 
-	std::vector<int> pix_count;
+	// Directions of the AO rays around +z, as x, y and z planes ao_dirs_stride floats apart
+	std::vector<float>	ao_dirs;
+	int					ao_dirs_stride;
 
 	void setupEmbree();
 	void releaseEmbree();
 
-	bool shootRay(const Vec3f& pos, const Vec3f& dir, Vec3f& n);
+	int packet_width;
+
+	// Sub-sample traced by the current progressive pass, -1 for all of them
+	Vec2i pass_sample;
+	// Adaptive refinement pass: only texels whose mean normal is shorter than sqrt(refine_len2) are traced
+	bool	refining;
+	float	refine_len2;
+	bool needsRefinement(const TiledMap::Tile& tile, const int texel) const;
+
+	// With bidir, the ray is bidirectional and its hits go to bidir instead of h
+	bool shootRay(const Vec3f& pos, const Vec3f& dir, HiHit& h, BidirHit* bidir = nullptr);
+	static void bidirFilter(const RTCFilterFunctionNArguments* args);
+	template<typename OnSample, typename OnRowEnd>
+	void rasterizeTriangle(	const Triangle& t, const Vec2i& tile_min, const Vec2i& tile_max,
+							OnSample on_sample, OnRowEnd on_row_end);
+	// Kernel for a grid side known at compile time, 0 for any
+	template<int SPP_SIDE, typename OnSample, typename OnRowEnd>
+	void rasterizeTriangleSpp(	const Triangle& t, const Vec2i& tile_min, const Vec2i& tile_max,
+								OnSample on_sample, OnRowEnd on_row_end);
+	void shootSamples(const Triangle& t, const BakeSample* samples, const int count, const Vec2i& tile_min);
+	template<typename RayHitN, int N>
+	void shootPacket(	const BakeSample*	samples,
+						const Vec3f*		dirs,
+						const bool*			active,
+						const int			count,
+						bool*				hit,
+						HiHit*				h,
+						BidirHit*			bidir);
+	// Unoccluded fraction of the hemisphere of n at pos. seed turns the ray pattern.
+	float ambientOcclusion(const Vec3f& pos, const Vec3f& n, const uint32_t seed);
+	template<typename RayN, int N>
+	float ambientOcclusionN(const Vec3f& pos, const Vec3f& n, const uint32_t seed);
+	Vec3f hiNormal(const uint id, const float a1, const float a2);
+	Vec3f hiVertexNormal(const uint32_t ni);
+	float hiCurvature(const uint id);
+	// Adds a hit to the baked channels of the tile at tile_min. tiles caches the touched tiles.
+	void accumulate(	TiledMap::Tile**	tiles,
+						const Vec2i&		tile_min,
+						const BakeSample&	s,
+						const HiHit&		h,
+						const Vec3f&		tn,
+						const bool			backwards);
+	int choosePacketWidth();
+
+	std::vector<std::vector<int>> binTrianglesByTile(const int tiles_x, const int tiles_y);
+
+	void computeLowTriangles();
 
-	Vec3f toTangSpace(	const Vec3f&	hi_n,
-						const Vec3f&	low_p, 
-						const Vec3f&	low_n,
-						const Vec2f&	uv,
-						const Triangle&	t);
+	Vec3f toTangSpace(	const Vec3f&		hi_n,
+						const BakeSample&	s,
+						const Triangle&		t);
 
-	void loadObj(std::string						inputfile, 
+	bool loadMesh(const std::string& filename, Mesh& mesh);
+	bool loadObj(std::string						inputfile, 
 				tinyobj::attrib_t&				attrib,
 				std::vector<tinyobj::shape_t>&	shapes);
 
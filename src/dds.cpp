@@ -0,0 +1,299 @@
+#include "dds.hpp"
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <vector>
+
+#include <emmintrin.h>
+
+#include "parallel.hpp"
+
+namespace {
+
+// Palette of a BC4 block. e0 > e1 interpolates 8 values, otherwise 6 plus 0 and 255.
+void bc4Palette(const int e0, const int e1, float p[8]) {
+	p[0] = e0;
+	p[1] = e1;
+	if(e0 > e1) {
+		for(int i = 1; i < 7; ++i) p[i + 1] = ((7 - i)*e0 + i*e1) / 7.0f;
+	} else {
+		for(int i = 1; i < 5; ++i) p[i + 1] = ((5 - i)*e0 + i*e1) / 5.0f;
+		p[6] = 0;
+		p[7] = 255;
+	}
+}
+
+// Weight of e0 in palette entry i, -1 for the constant entries
+float bc4Weight(const bool eight, const int i) {
+	if(i < 2) return 1 - i;
+	if(eight) return (8 - i) / 7.0f;
+	return i < 6 ? (6 - i) / 5.0f : -1;
+}
+
+struct Bc4Fit {
+	int		e0, e1;
+	int		idx[16];
+	float	err;
+};
+
+// Nearest palette entry of every value, 4 values at a time. Returns the squared error.
+float bc4Indices(const __m128 v[4], const float p[8], int idx[16]) {
+	__m128 err = _mm_setzero_ps();
+	for(int q = 0; q < 4; ++q) {
+		__m128 best = _mm_set1_ps(FLT_MAX);
+		__m128i best_i = _mm_setzero_si128();
+		for(int i = 0; i < 8; ++i) {
+			const __m128 d = _mm_sub_ps(v[q], _mm_set1_ps(p[i]));
+			const __m128 e = _mm_mul_ps(d, d);
+			const __m128i closer = _mm_castps_si128(_mm_cmplt_ps(e, best));
+			best = _mm_min_ps(e, best);
+			best_i = _mm_or_si128(_mm_and_si128(closer, _mm_set1_epi32(i)), _mm_andnot_si128(closer, best_i));
+		}
+		err = _mm_add_ps(err, best);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(idx + 4*q), best_i);
+	}
+	alignas(16) float e[4];
+	_mm_store_ps(e, err);
+	return e[0] + e[1] + e[2] + e[3];
+}
+
+// Keeps the endpoints (e0, e1) in best if they fit v better
+void bc4Try(const __m128 v[4], int e0, int e1, Bc4Fit& best) {
+	e0 = std::min(std::max(e0, 0), 255);
+	e1 = std::min(std::max(e1, 0), 255);
+	float p[8];
+	bc4Palette(e0, e1, p);
+	Bc4Fit fit;
+	fit.e0 = e0;
+	fit.e1 = e1;
+	fit.err = bc4Indices(v, p, fit.idx);
+	if(fit.err < best.err) best = fit;
+}
+
+// Least squares endpoints for the indices of fit, keeping its mode. False if they are undetermined.
+bool bc4Refine(const float* values, const Bc4Fit& fit, int& e0, int& e1) {
+	const bool eight = fit.e0 > fit.e1;
+	float aa = 0, ab = 0, bb = 0, av = 0, bv = 0;
+	for(int k = 0; k < 16; ++k) {
+		const float a = bc4Weight(eight, fit.idx[k]);
+		if(a < 0) continue;
+		const float b = 1 - a;
+		aa += a*a;
+		ab += a*b;
+		bb += b*b;
+		av += a*values[k];
+		bv += b*values[k];
+	}
+	const float det = aa*bb - ab*ab;
+	if(std::abs(det) < 1e-6f) return false;
+	e0 = std::lround((av*bb - bv*ab) / det);
+	e1 = std::lround((bv*aa - av*ab) / det);
+	return eight ? e0 > e1 : e0 <= e1;
+}
+
+// Encodes 16 values in 0 ... 255 as an 8 byte BC4 block
+void encodeBc4(const float* values, const BcQuality quality, unsigned char* out) {
+	__m128 v[4];
+	for(int q = 0; q < 4; ++q) v[q] = _mm_loadu_ps(values + 4*q);
+	__m128 lo4 = _mm_min_ps(_mm_min_ps(v[0], v[1]), _mm_min_ps(v[2], v[3]));
+	__m128 hi4 = _mm_max_ps(_mm_max_ps(v[0], v[1]), _mm_max_ps(v[2], v[3]));
+	lo4 = _mm_min_ps(lo4, _mm_shuffle_ps(lo4, lo4, _MM_SHUFFLE(1, 0, 3, 2)));
+	hi4 = _mm_max_ps(hi4, _mm_shuffle_ps(hi4, hi4, _MM_SHUFFLE(1, 0, 3, 2)));
+	lo4 = _mm_min_ps(lo4, _mm_shuffle_ps(lo4, lo4, _MM_SHUFFLE(2, 3, 0, 1)));
+	hi4 = _mm_max_ps(hi4, _mm_shuffle_ps(hi4, hi4, _MM_SHUFFLE(2, 3, 0, 1)));
+	const int lo = std::lround(_mm_cvtss_f32(lo4));
+	const int hi = std::lround(_mm_cvtss_f32(hi4));
+
+	Bc4Fit best;
+	best.err = FLT_MAX;
+	// A flat block is the first entry of the 6 value palette
+	bc4Try(v, hi, hi == lo ? hi : lo, best);
+
+	if(hi > lo && quality >= BC_QUALITY_NORMAL) {
+		for(int iter = 0; iter < 2; ++iter) {
+			int e0, e1;
+			if(!bc4Refine(values, best, e0, e1)) break;
+			const float err = best.err;
+			bc4Try(v, e0, e1, best);
+			if(best.err >= err) break;
+		}
+	}
+
+	if(hi > lo && quality >= BC_QUALITY_HIGH) {
+		const int e0 = best.e0, e1 = best.e1;
+		for(int d0 = -2; d0 <= 2; ++d0)
+			for(int d1 = -2; d1 <= 2; ++d1)
+				if(e0 + d0 > e1 + d1) bc4Try(v, e0 + d0, e1 + d1, best);
+
+		// The 6 value mode over the values away from 0 and 255, which the palette has anyway
+		int in_lo = 255, in_hi = 0;
+		for(int k = 0; k < 16; ++k) {
+			if(values[k] < 16 || values[k] > 239) continue;
+			in_lo = std::min(in_lo, (int)std::lround(values[k]));
+			in_hi = std::max(in_hi, (int)std::lround(values[k]));
+		}
+		if(in_lo <= in_hi && (in_lo > lo || in_hi < hi)) {
+			Bc4Fit six;
+			six.err = FLT_MAX;
+			bc4Try(v, in_lo, in_hi, six);
+			int r0, r1;
+			if(bc4Refine(values, six, r0, r1)) bc4Try(v, r0, r1, six);
+			if(six.err < best.err) best = six;
+		}
+	}
+
+	uint64_t bits = 0;
+	for(int k = 0; k < 16; ++k)
+		bits |= (uint64_t)best.idx[k] << (3*k);
+	out[0] = best.e0;
+	out[1] = best.e1;
+	for(int b = 0; b < 6; ++b)
+		out[2 + b] = bits >> (8*b);
+}
+
+struct Mip {
+	const float*		data;
+	std::vector<float>	own;
+	int					w, h, stride;
+	size_t				offset;		// Of the blocks in the file data
+};
+
+// 2x2 box filter of src, renormalizing unit vectors
+void downsample(const Mip& src, Mip& dst, const bool unit_vectors, const int threads_num) {
+	dst.w = std::max(1, src.w / 2);
+	dst.h = std::max(1, src.h / 2);
+	dst.stride = 3*dst.w;
+	dst.own.resize((size_t)dst.stride*dst.h);
+	dst.data = dst.own.data();
+
+	parallelFor(dst.h, threads_num, [&](const size_t j) {
+		const int j0 = std::min<int>(2*j, src.h - 1), j1 = std::min<int>(2*j + 1, src.h - 1);
+		float* out = dst.own.data() + j*dst.stride;
+		for(int i = 0; i < dst.w; ++i) {
+			const int i0 = std::min(2*i, src.w - 1), i1 = std::min(2*i + 1, src.w - 1);
+			float v[3];
+			for(int c = 0; c < 3; ++c)
+				v[c] = 0.25f*(	src.data[(size_t)j0*src.stride + 3*i0 + c] + src.data[(size_t)j0*src.stride + 3*i1 + c] +
+								src.data[(size_t)j1*src.stride + 3*i0 + c] + src.data[(size_t)j1*src.stride + 3*i1 + c]);
+			if(unit_vectors) {
+				float n[3], len2 = 0;
+				for(int c = 0; c < 3; ++c) {
+					n[c] = 2*v[c] - 1;
+					len2 += n[c]*n[c];
+				}
+				if(len2 > 1e-12f) {
+					const float inv = 1 / std::sqrt(len2);
+					for(int c = 0; c < 3; ++c) v[c] = n[c]*inv*0.5f + 0.5f;
+				}
+			}
+			for(int c = 0; c < 3; ++c) out[3*i + c] = v[c];
+		}
+	});
+}
+
+void putLE32(std::vector<unsigned char>& buf, const uint32_t v) {
+	buf.push_back(v);
+	buf.push_back(v >> 8);
+	buf.push_back(v >> 16);
+	buf.push_back(v >> 24);
+}
+
+}
+
+bool writeDdsBc5(	const std::string&			filename,
+					const float*				data,
+					const int					w,
+					const int					h,
+					const int					stride,
+					const bool					unit_vectors,
+					const ImageEncodeSettings&	settings,
+					ImageEncodeStats*			stats) {
+
+	const auto start = std::chrono::steady_clock::now();
+
+	// Mips down to 1x1, and where their blocks go
+	std::vector<Mip> mips(1);
+	mips[0].data = data;
+	mips[0].w = w;
+	mips[0].h = h;
+	mips[0].stride = stride;
+	while(mips.back().w > 1 || mips.back().h > 1) {
+		mips.emplace_back();
+		downsample(mips[mips.size() - 2], mips.back(), unit_vectors, settings.threads_num);
+	}
+
+	// Every job is a row of blocks of a mip
+	std::vector<std::pair<int, int>> block_rows;
+	size_t size = 0;
+	for(size_t m = 0; m < mips.size(); ++m) {
+		mips[m].offset = size;
+		const int bh = (mips[m].h + 3) / 4;
+		for(int by = 0; by < bh; ++by) block_rows.emplace_back(m, by);
+		size += 16*(size_t)((mips[m].w + 3) / 4)*bh;
+	}
+	if(size > 0xFFFFFFFFu) {
+		std::cerr << filename << " would be too large for a DDS file" << std::endl;
+		return false;
+	}
+
+	std::vector<unsigned char> blocks(size);
+	parallelFor(block_rows.size(), settings.threads_num, [&](const size_t r) {
+		const Mip& mip = mips[block_rows[r].first];
+		const int by = block_rows[r].second;
+		const int bw = (mip.w + 3) / 4;
+		unsigned char* out = blocks.data() + mip.offset + 16*(size_t)bw*by;
+		// Blocks past the edges repeat the last row and column
+		float values[2][16];
+		for(int bx = 0; bx < bw; ++bx) {
+			for(int y = 0; y < 4; ++y) {
+				const float* row = mip.data + (size_t)std::min(4*by + y, mip.h - 1)*mip.stride;
+				for(int x = 0; x < 4; ++x) {
+					const float* t = row + 3*std::min(4*bx + x, mip.w - 1);
+					for(int c = 0; c < 2; ++c)
+						values[c][4*y + x] = std::min(std::max(t[c], 0.0f), 1.0f)*255;
+				}
+			}
+			encodeBc4(values[0], settings.bc_quality, out + 16*bx);
+			encodeBc4(values[1], settings.bc_quality, out + 16*bx + 8);
+		}
+	});
+
+	// DDS_HEADER with the ATI2 four CC, which every BC5 reader knows
+	std::vector<unsigned char> head{'D', 'D', 'S', ' '};
+	putLE32(head, 124);
+	putLE32(head, 0x1 | 0x2 | 0x4 | 0x1000 | 0x20000 | 0x80000);	// Caps, height, width, pixel format, mip count, linear size
+	putLE32(head, h);
+	putLE32(head, w);
+	putLE32(head, mips.size() > 1 ? mips[1].offset : size);		// Bytes of the top mip
+	putLE32(head, 0);											// Depth
+	putLE32(head, mips.size());
+	for(int k = 0; k < 11; ++k) putLE32(head, 0);
+	putLE32(head, 32);											// DDS_PIXELFORMAT
+	putLE32(head, 0x4);											// Four CC
+	head.insert(head.end(), {'A', 'T', 'I', '2'});
+	for(int k = 0; k < 5; ++k) putLE32(head, 0);
+	putLE32(head, 0x8 | 0x1000 | 0x400000);						// Complex, texture, mipmap
+	for(int k = 0; k < 4; ++k) putLE32(head, 0);
+
+	FILE* f = fopen(filename.c_str(), "wb");
+	if(!f) {
+		std::cerr << "Cannot open " << filename << std::endl;
+		return false;
+	}
+	fwrite(head.data(), 1, head.size(), f);
+	fwrite(blocks.data(), 1, blocks.size(), f);
+	const bool ok = !ferror(f);
+	fclose(f);
+
+	if(stats) {
+		stats->raw_bytes = 3*sizeof(float)*(size_t)w*h;
+		stats->file_bytes = head.size() + blocks.size();
+		stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+	return ok;
+}
@@ -0,0 +1,22 @@
+#ifndef _DDS_HPP_
+#define _DDS_HPP_
+
+#include <string>
+
+#include "image.hpp"
+
+// Writes the first two components of RGB data in 0 ... 1 as a BC5 DDS file with a full mip chain.
+// Every mip is the 2x2 box filter of the previous one. With unit_vectors the data are vectors
+// encoded as v*0.5 + 0.5, renormalized after filtering. The 4x4 blocks of all the mips are
+// encoded on settings.threads_num threads with settings.bc_quality. Rows are stride floats
+// apart, top row first.
+bool writeDdsBc5(	const std::string&			filename,
+					const float*				data,
+					const int					w,
+					const int					h,
+					const int					stride,
+					const bool					unit_vectors,
+					const ImageEncodeSettings&	settings = {DEF_COMPRESSION_LEVEL, 0},
+					ImageEncodeStats*			stats = nullptr);
+
+#endif
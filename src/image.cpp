@@ -0,0 +1,350 @@
+#include "image.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <vector>
+
+#include <zlib.h>
+
+#include "parallel.hpp"
+
+namespace {
+
+// Raw bytes per band, enough to keep a thread busy and to compress well on their own
+const size_t band_bytes = 1 << 18;
+
+void putU32(std::vector<unsigned char>& buf, const uint32_t v) {
+	buf.push_back(v >> 24);
+	buf.push_back(v >> 16);
+	buf.push_back(v >> 8);
+	buf.push_back(v);
+}
+
+// TIFF files are written little endian
+void putLE16(std::vector<unsigned char>& buf, const uint16_t v) {
+	buf.push_back(v);
+	buf.push_back(v >> 8);
+}
+
+void putLE32(std::vector<unsigned char>& buf, const uint32_t v) {
+	buf.push_back(v);
+	buf.push_back(v >> 8);
+	buf.push_back(v >> 16);
+	buf.push_back(v >> 24);
+}
+
+void writeChunk(FILE* f, const char* type, const std::vector<unsigned char>& data) {
+	std::vector<unsigned char> head;
+	putU32(head, data.size());
+	head.insert(head.end(), type, type + 4);
+
+	uLong crc = crc32(0, reinterpret_cast<const Bytef*>(type), 4);
+	if(!data.empty()) crc = crc32(crc, data.data(), data.size());	// A null buffer would reset it
+	std::vector<unsigned char> tail;
+	putU32(tail, crc);
+
+	fwrite(head.data(), 1, head.size(), f);
+	fwrite(data.data(), 1, data.size(), f);
+	fwrite(tail.data(), 1, tail.size(), f);
+}
+
+inline unsigned char paeth(const int a, const int b, const int c) {
+	const int p = a + b - c;
+	const int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+	if(pa <= pb && pa <= pc) return a;
+	return pb <= pc ? b : c;
+}
+
+// Filters cur into r with PNG filter F and returns the sum of the absolute values of the result
+template<int F>
+size_t filterRow(const unsigned char* cur, const unsigned char* prev, const size_t n, const int bpp, unsigned char* r) {
+	size_t cost = 0;
+	for(size_t i = 0; i < n; ++i) {
+		const int a = i >= (size_t)bpp ? cur[i - bpp] : 0;
+		const int b = prev[i];
+		const int c = i >= (size_t)bpp ? prev[i - bpp] : 0;
+		unsigned char v = cur[i];
+		if(F == 1) v -= a;
+		if(F == 2) v -= b;
+		if(F == 3) v -= (a + b) / 2;
+		if(F == 4) v -= paeth(a, b, c);
+		r[i] = v;
+		cost += v < 128 ? v : 256 - v;
+	}
+	return cost;
+}
+
+// Appends the filter type and the filtered bytes of cur to out. Picks the filter with the
+// smallest sum of absolute differences, as libpng does, or none when storing.
+void filterRow(	const unsigned char* cur, const unsigned char* prev, const size_t n, const int bpp,
+				const bool adaptive, std::vector<unsigned char>& rows, std::vector<unsigned char>& out) {
+	if(!adaptive) {
+		out.push_back(0);
+		out.insert(out.end(), cur, cur + n);
+		return;
+	}
+	rows.resize(5*n);
+	const size_t costs[5] = {
+		filterRow<0>(cur, prev, n, bpp, rows.data()),
+		filterRow<1>(cur, prev, n, bpp, rows.data() + n),
+		filterRow<2>(cur, prev, n, bpp, rows.data() + 2*n),
+		filterRow<3>(cur, prev, n, bpp, rows.data() + 3*n),
+		filterRow<4>(cur, prev, n, bpp, rows.data() + 4*n)
+	};
+	const int best = std::min_element(costs, costs + 5) - costs;
+	out.push_back(best);
+	out.insert(out.end(), rows.data() + best*n, rows.data() + (best + 1)*n);
+}
+
+struct Band {
+	std::vector<unsigned char>	z;
+	uLong						adler;
+	size_t						raw;
+	bool						ok;
+};
+
+// PNG of h rows of w pixels of bpp bytes. rowBytes(j, dst) writes the bytes of row j, top row first.
+bool encodePng(	const std::string&			filename,
+				const int					w,
+				const int					h,
+				const int					bit_depth,
+				const std::function<void(int, unsigned char*)>& rowBytes,
+				const ImageEncodeSettings&	settings,
+				ImageEncodeStats*			stats) {
+
+	const auto start = std::chrono::steady_clock::now();
+	const int bpp = 3*bit_depth / 8;
+	const size_t row_size = (size_t)bpp*w;
+	const int band_rows = std::max<size_t>(1, band_bytes / row_size);
+	const int bands_num = (h + band_rows - 1) / band_rows;
+	const int level = std::min(std::max(settings.compression_level, 0), 9);
+
+	// Every band is a raw deflate stream that ends byte aligned on a sync flush, and the
+	// last one on the final block, so they join into a single stream. Their Adler-32 combine.
+	std::vector<Band> bands(bands_num);
+	parallelFor(bands_num, settings.threads_num, [&](const size_t b) {
+		const int j0 = b*band_rows, j1 = std::min(h, j0 + band_rows);
+		std::vector<unsigned char> prev(row_size, 0), cur(row_size), rows;
+		if(j0 > 0) rowBytes(j0 - 1, prev.data());
+
+		std::vector<unsigned char> filtered;
+		filtered.reserve((j1 - j0)*(row_size + 1));
+		for(int j = j0; j < j1; ++j) {
+			rowBytes(j, cur.data());
+			filterRow(cur.data(), prev.data(), row_size, bpp, level > 0, rows, filtered);
+			std::swap(cur, prev);
+		}
+
+		Band& band = bands[b];
+		band.raw = filtered.size();
+		band.adler = adler32(adler32(0, nullptr, 0), filtered.data(), filtered.size());
+
+		z_stream zs{};
+		band.ok = deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+		if(!band.ok) return;
+		band.z.resize(deflateBound(&zs, filtered.size()) + 64);
+		zs.next_in = filtered.data();
+		zs.avail_in = filtered.size();
+		zs.next_out = band.z.data();
+		zs.avail_out = band.z.size();
+		const int ret = deflate(&zs, (int)b == bands_num - 1 ? Z_FINISH : Z_SYNC_FLUSH);
+		band.ok = zs.avail_in == 0 && (ret == Z_STREAM_END || ret == Z_OK);
+		band.z.resize(zs.total_out);
+		deflateEnd(&zs);
+	});
+
+	std::vector<unsigned char> z{0x78, 0x9C};
+	uLong adler = adler32(0, nullptr, 0);
+	size_t z_size = 2 + 4;
+	for(const Band& band : bands) {
+		if(!band.ok) {
+			std::cerr << "Cannot compress " << filename << std::endl;
+			return false;
+		}
+		z_size += band.z.size();
+	}
+	z.reserve(z_size);
+	for(const Band& band : bands) {
+		z.insert(z.end(), band.z.begin(), band.z.end());
+		adler = adler32_combine(adler, band.adler, band.raw);
+	}
+	putU32(z, adler);
+
+	FILE* f = fopen(filename.c_str(), "wb");
+	if(!f) {
+		std::cerr << "Cannot open " << filename << std::endl;
+		return false;
+	}
+
+	const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+	fwrite(signature, 1, 8, f);
+
+	std::vector<unsigned char> ihdr;
+	putU32(ihdr, w);
+	putU32(ihdr, h);
+	ihdr.push_back(bit_depth);
+	ihdr.push_back(2);	// Color type: RGB
+	ihdr.push_back(0);	// Compression
+	ihdr.push_back(0);	// Filter
+	ihdr.push_back(0);	// Interlace
+	writeChunk(f, "IHDR", ihdr);
+	writeChunk(f, "IDAT", z);
+	writeChunk(f, "IEND", {});
+
+	const bool ok = !ferror(f);
+	fclose(f);
+
+	if(stats) {
+		stats->raw_bytes = row_size*h;
+		stats->file_bytes = 8 + 25 + (z.size() + 12) + 12;
+		stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+	return ok;
+}
+
+}
+
+bool writePng(	const std::string&			filename,
+				const unsigned char*		data,
+				const int					w,
+				const int					h,
+				const int					stride,
+				const ImageEncodeSettings&	settings,
+				ImageEncodeStats*			stats) {
+	return encodePng(filename, w, h, 8, [&](const int j, unsigned char* dst) {
+		std::memcpy(dst, data + (size_t)j*stride, 3*(size_t)w);
+	}, settings, stats);
+}
+
+bool writePng16(const std::string&			filename,
+				const uint16_t*				data,
+				const int					w,
+				const int					h,
+				const int					stride,
+				const ImageEncodeSettings&	settings,
+				ImageEncodeStats*			stats) {
+	// PNG samples are big endian
+	return encodePng(filename, w, h, 16, [&](const int j, unsigned char* dst) {
+		const uint16_t* row = data + (size_t)j*stride;
+		for(int i = 0; i < 3*w; ++i) {
+			dst[2*i + 0] = row[i] >> 8;
+			dst[2*i + 1] = row[i] & 0xFF;
+		}
+	}, settings, stats);
+}
+
+bool writeTiffFloat(const std::string&			filename,
+					const float*				data,
+					const int					w,
+					const int					h,
+					const int					stride,
+					const ImageEncodeSettings&	settings,
+					ImageEncodeStats*			stats) {
+
+	const auto start = std::chrono::steady_clock::now();
+	const size_t row_size = 3*sizeof(float)*(size_t)w;
+	const int strip_rows = std::max<size_t>(1, band_bytes / row_size);
+	const int strips_num = (h + strip_rows - 1) / strip_rows;
+	const int level = std::min(std::max(settings.compression_level, 0), 9);
+
+	// Every strip is a zlib stream of its own. Floats are stored as in memory, little endian on x86.
+	std::vector<std::vector<unsigned char>> strips(strips_num);
+	std::vector<char> strip_ok(strips_num, 1);
+	parallelFor(strips_num, settings.threads_num, [&](const size_t s) {
+		const int j0 = s*strip_rows, j1 = std::min(h, j0 + strip_rows);
+		std::vector<unsigned char> raw((j1 - j0)*row_size);
+		for(int j = j0; j < j1; ++j)
+			std::memcpy(raw.data() + (j - j0)*row_size, data + (size_t)j*stride, row_size);
+		if(level == 0) {
+			strips[s] = std::move(raw);
+			return;
+		}
+		uLongf z_size = compressBound(raw.size());
+		strips[s].resize(z_size);
+		strip_ok[s] = compress2(strips[s].data(), &z_size, raw.data(), raw.size(), level) == Z_OK;
+		strips[s].resize(z_size);
+	});
+	if(std::find(strip_ok.begin(), strip_ok.end(), 0) != strip_ok.end()) {
+		std::cerr << "Cannot compress " << filename << std::endl;
+		return false;
+	}
+
+	// Header, strips, tag arrays and the IFD, at even offsets
+	uint64_t offset = 8;
+	std::vector<uint32_t> strip_offsets, strip_sizes;
+	for(const auto& strip : strips) {
+		strip_offsets.push_back(offset);
+		strip_sizes.push_back(strip.size());
+		offset += strip.size() + (strip.size() & 1);
+	}
+	const uint64_t arrays_offset = offset;
+	const uint64_t ifd_offset = arrays_offset + 2*6 + 2*4*(uint64_t)strips_num;
+	if(ifd_offset + 2 + 11*12 + 4 > 0xFFFFFFFFu) {
+		std::cerr << filename << " would be larger than the 4 GiB a TIFF can hold" << std::endl;
+		return false;
+	}
+
+	std::vector<unsigned char> head{'I', 'I'};
+	putLE16(head, 42);
+	putLE32(head, ifd_offset);
+
+	// Bits per sample, sample formats, then the strip offsets and sizes
+	std::vector<unsigned char> tail;
+	for(int c = 0; c < 3; ++c) putLE16(tail, 32);
+	for(int c = 0; c < 3; ++c) putLE16(tail, 3);	// IEEE float
+	for(const uint32_t o : strip_offsets) putLE32(tail, o);
+	for(const uint32_t s : strip_sizes) putLE32(tail, s);
+
+	const auto entry = [&](const uint16_t tag, const uint16_t type, const uint32_t count, const uint32_t value) {
+		putLE16(tail, tag);
+		putLE16(tail, type);
+		putLE32(tail, count);
+		putLE32(tail, value);
+	};
+	const uint16_t SHORT = 3, LONG = 4;
+	// A single value is stored in place
+	const auto array = [&](const uint32_t count, const uint32_t array_offset, const uint32_t single) {
+		return count == 1 ? single : array_offset;
+	};
+	const uint32_t offsets_at = arrays_offset + 12;
+	const uint32_t sizes_at = offsets_at + 4*strips_num;
+	putLE16(tail, 11);
+	entry(256, LONG, 1, w);								// Image width
+	entry(257, LONG, 1, h);								// Image length
+	entry(258, SHORT, 3, arrays_offset);				// Bits per sample
+	entry(259, SHORT, 1, level == 0 ? 1 : 8);			// Compression: none or deflate
+	entry(262, SHORT, 1, 2);							// Photometric interpretation: RGB
+	entry(273, LONG, strips_num, array(strips_num, offsets_at, strip_offsets[0]));
+	entry(277, SHORT, 1, 3);							// Samples per pixel
+	entry(278, LONG, 1, strip_rows);					// Rows per strip
+	entry(279, LONG, strips_num, array(strips_num, sizes_at, strip_sizes[0]));
+	entry(284, SHORT, 1, 1);							// Planar configuration: interleaved
+	entry(339, SHORT, 3, arrays_offset + 6);			// Sample format
+	putLE32(tail, 0);									// No next IFD
+
+	FILE* f = fopen(filename.c_str(), "wb");
+	if(!f) {
+		std::cerr << "Cannot open " << filename << std::endl;
+		return false;
+	}
+	fwrite(head.data(), 1, head.size(), f);
+	for(const auto& strip : strips) {
+		fwrite(strip.data(), 1, strip.size(), f);
+		if(strip.size() & 1) fputc(0, f);
+	}
+	fwrite(tail.data(), 1, tail.size(), f);
+	const bool ok = !ferror(f);
+	fclose(f);
+
+	if(stats) {
+		stats->raw_bytes = row_size*h;
+		stats->file_bytes = arrays_offset + tail.size();
+		stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+	return ok;
+}
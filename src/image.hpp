@@ -0,0 +1,69 @@
+#ifndef _IMAGE_HPP_
+#define _IMAGE_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// zlib level of the PNG and TIFF encoders
+#define DEF_COMPRESSION_LEVEL 6
+
+enum ImageFormat {
+	IMAGE_PNG8,			// 8 bit RGB PNG
+	IMAGE_PNG16,		// 16 bit RGB PNG
+	IMAGE_TIFF_FLOAT,	// 32 bit float RGB TIFF, unquantized values
+	IMAGE_DDS_BC5		// BC5 DDS with all mips, first two components
+};
+
+// Block compression effort
+enum BcQuality {
+	BC_QUALITY_FAST,	// Block range endpoints
+	BC_QUALITY_NORMAL,	// Least squares refined endpoints
+	BC_QUALITY_HIGH		// Endpoint search and both BC4 modes
+};
+
+struct ImageEncodeSettings {
+	int		compression_level;	// zlib level: 0 stores, 1 is the fastest, 9 the smallest
+	int		threads_num;		// 0 means one per hardware thread
+	BcQuality	bc_quality = BC_QUALITY_NORMAL;	// Block compressed formats
+};
+
+struct ImageEncodeStats {
+	size_t	raw_bytes;		// Pixel data
+	size_t	file_bytes;
+	double	seconds;		// Filtering, compression and writing
+};
+
+// The encoders split the image in bands of rows that are filtered and compressed
+// on several threads. PNG bands are independent deflate streams joined into one,
+// TIFF bands are compressed strips. Rows are stride elements apart, top row first.
+// stats, if not null, receives the sizes and the encode time.
+
+// Writes 8 bit RGB data as a PNG file
+bool writePng(	const std::string&			filename,
+				const unsigned char*		data,
+				const int					w,
+				const int					h,
+				const int					stride,
+				const ImageEncodeSettings&	settings = {DEF_COMPRESSION_LEVEL, 0},
+				ImageEncodeStats*			stats = nullptr);
+
+// Writes 16 bit RGB data as a PNG file
+bool writePng16(const std::string&			filename,
+				const uint16_t*				data,
+				const int					w,
+				const int					h,
+				const int					stride,
+				const ImageEncodeSettings&	settings = {DEF_COMPRESSION_LEVEL, 0},
+				ImageEncodeStats*			stats = nullptr);
+
+// Writes float RGB data as a deflate compressed TIFF file
+bool writeTiffFloat(const std::string&			filename,
+					const float*				data,
+					const int					w,
+					const int					h,
+					const int					stride,
+					const ImageEncodeSettings&	settings = {DEF_COMPRESSION_LEVEL, 0},
+					ImageEncodeStats*			stats = nullptr);
+
+#endif
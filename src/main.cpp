@@ -1,5 +1,3 @@
-#define TINYOBJLOADER_IMPLEMENTATION
-
 #define VERBOSE 1
 #include <iostream>
 
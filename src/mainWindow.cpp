@@ -1,6 +1,9 @@
 
 #include "mainWindow.hpp"
 
+// Side of the progressive bake preview, in pixels
+#define PREVIEW_SIZE 256
+
 MainWindow::MainWindow() :	QWidget(),
 							core() {
 	setWindowTitle("Baker");
@@ -11,6 +14,8 @@ MainWindow::MainWindow() :	QWidget(),
 	QLabel* highPolyLabel	= new QLabel("High poly model");
 	QLabel* outFileLabel	= new QLabel("Out texture file");
 	QLabel* mapSizeLabel	= new QLabel("Map size");
+	QLabel* threadsLabel	= new QLabel("Threads");
+	QLabel* progressiveLabel	= new QLabel("Progressive");
 
 	lowPolyFileLabel	= new QLineEdit("No file selected");
 	highPolyFileLabel	= new QLineEdit("No file selected");
@@ -28,6 +33,15 @@ MainWindow::MainWindow() :	QWidget(),
 	mapSizeCombo->addItem("8192x8192");
 	setMapSize("256x256");
 
+	// 0 means one thread per core
+	threadsSpin			= new QSpinBox();
+	threadsSpin->setRange(0, 256);
+	threadsSpin->setSpecialValueText("Auto");
+	threadsSpin->setValue(0);
+
+	// One sample per texel first, refined pass by pass
+	progressiveCheck	= new QCheckBox();
+
 	lowPolyFileLabel->setReadOnly(true);
 	highPolyFileLabel->setReadOnly(true);
 	outFileFileLabel->setReadOnly(true);
@@ -44,12 +58,25 @@ MainWindow::MainWindow() :	QWidget(),
 	loadPanelLayout->addWidget(outFileChooseBtn,	2, 2);
 	loadPanelLayout->addWidget(mapSizeLabel,		3, 0);
 	loadPanelLayout->addWidget(mapSizeCombo,		3, 1);
+	loadPanelLayout->addWidget(threadsLabel,		4, 0);
+	loadPanelLayout->addWidget(threadsSpin,			4, 1);
+	loadPanelLayout->addWidget(progressiveLabel,	5, 0);
+	loadPanelLayout->addWidget(progressiveCheck,	5, 1);
 
 	startBakingBtn = new QPushButton("Start baking");
 	progressBar = new QProgressBar();
 	progressBar->setMinimum(0);
-	progressBar->setMaximum(10);
+	progressBar->setMaximum(1000);
 	progressBar->setValue(0);
+	statusLabel = new QLabel();
+	previewLabel = new QLabel();
+	previewLabel->setFixedSize(PREVIEW_SIZE, PREVIEW_SIZE);
+	previewLabel->setAlignment(Qt::AlignCenter);
+	previewChanged = false;
+
+	// Polls the bake progress while baking
+	progressTimer = new QTimer(this);
+	progressTimer->setInterval(200);
 
 	QHBoxLayout* startBar = new QHBoxLayout();
 	startBar->addWidget(progressBar);
@@ -57,22 +84,30 @@ MainWindow::MainWindow() :	QWidget(),
 
 	mainLayout->addLayout(loadPanelLayout);
 	mainLayout->addLayout(startBar);
+	mainLayout->addWidget(statusLabel);
+	mainLayout->addWidget(previewLabel, 0, Qt::AlignCenter);
 	setLayout(mainLayout);
 
 	connect(highPolyLoadBtn,	SIGNAL(clicked()), this,	SLOT(loadHighObj()));
 	connect(lowPolyLoadBtn,		SIGNAL(clicked()), this,	SLOT(loadLowObj()));
 	connect(outFileChooseBtn,	SIGNAL(clicked()), this,	SLOT(selectOutFile()));
 	connect(mapSizeCombo,		SIGNAL(activated(QString)), this, SLOT(setMapSize(QString)));
+	connect(threadsSpin,		SIGNAL(valueChanged(int)), this, SLOT(setThreadsNum(int)));
 	connect(startBakingBtn,		SIGNAL(clicked()), this,	SLOT(generateMap()));
+	connect(progressTimer,		SIGNAL(timeout()), this,	SLOT(updateProgress()));
 
 	lowPolyLoaded = false;
 	highPolyLoaded = false;
+	baking = false;
 	outFilePath = QString();
 	startBakingBtn->setEnabled(false);
 
 }
 
 MainWindow::~MainWindow() {
+	// The completion call queued by a running bake is dropped along with the window
+	core.cancelBake();
+	core.waitBake();
 }
 
 void MainWindow::loadHighObj() {
@@ -105,8 +140,6 @@ void MainWindow::loadLowObj() {
 
 	core.loadLowObj(filepath.toUtf8().constData());
 
-	progressBar->setMaximum(core.getLowTrisNum());
-
 	std::cout << "DONE" << std::endl;
 
 	lowPolyFileLabel->setText(filepath);
@@ -117,7 +150,7 @@ void MainWindow::loadLowObj() {
 }
 
 void MainWindow::selectOutFile() {
-	const auto filepath = QFileDialog::getSaveFileName(this, "Select out file", "./", "*.png");
+	const auto filepath = QFileDialog::getSaveFileName(this, "Select out file", "./", "*.png *.tif *.tiff *.dds");
 	if(filepath.isEmpty()) return;
 	outFilePath = filepath;
 	outFileFileLabel->setText(filepath);
@@ -131,69 +164,102 @@ void MainWindow::setMapSize(QString s) {
 	core.tex_h = w;
 }
 
+void MainWindow::setThreadsNum(int n) {
+	core.threads_num = n;
+}
+
 void MainWindow::generateMap() {
 
+	if(baking) {
+		// A progressive bake stops at the end of the current pass and keeps what it has
+		core.cancelBake();
+		startBakingBtn->setEnabled(false);
+		statusLabel->setText(core.progressive ? "Stopping..." : "Cancelling...");
+		return;
+	}
+
 	// Fixes width so the label change doesn't change the button's size
 	startBakingBtn->setMinimumWidth(startBakingBtn->width());
 	lockButtons();
-	startBakingBtn->setText("Baking...");
-	repaint();
-
-	//emit startMapGenerationSig();
+	core.progressive = progressiveCheck->isChecked();
+	startBakingBtn->setText(core.progressive ? "Stop" : "Cancel");
+	startBakingBtn->setEnabled(true);
+	progressBar->setValue(0);
+	statusLabel->setText("Baking...");
+	previewLabel->clear();
+	passStatus.clear();
+	baking = true;
 
 	core.clearBuffers();
-	const auto trinum = core.getLowTrisNum();
-	
-	for (int ti = 0; ti < trinum; ++ti) {
-		core.generateNormalMapOnTriangle(ti);
-		if(ti % 100 == 0) {
-			progressBar->setValue(ti);
-		}
+
+	// The preview is built on the bake thread between passes, when the accumulators are not written
+	core.on_pass = [this](const int passes_done, const int passes_total) {
+		QImage img{core.tex_w, core.tex_h, QImage::Format_RGB888};
+		core.previewMap(img.bits(), img.bytesPerLine());
+		QMetaObject::invokeMethod(this, "passFinished", Qt::QueuedConnection,
+									Q_ARG(QImage, img.scaled(PREVIEW_SIZE, PREVIEW_SIZE, Qt::KeepAspectRatio, Qt::SmoothTransformation)),
+									Q_ARG(int, passes_done), Q_ARG(int, passes_total));
+	};
+
+	// The map is encoded and saved on the bake thread too, then the result goes back to the GUI thread.
+	// TIFFs keep the unquantized normals, DDS files are BC5 compressed from them.
+	const QString path = outFilePath;
+	ImageFormat format = IMAGE_PNG8;
+	if(path.endsWith(".tif", Qt::CaseInsensitive) || path.endsWith(".tiff", Qt::CaseInsensitive))
+		format = IMAGE_TIFF_FLOAT;
+	else if(path.endsWith(".dds", Qt::CaseInsensitive))
+		format = IMAGE_DDS_BC5;
+	core.startNormalMap([this, path, format](const bool done) {
+		bool saved = false;
+		if(done)
+			saved = core.writeChannel(CHANNEL_NORMAL, path.toStdString(), format);
+		QMetaObject::invokeMethod(this, "bakeFinished", Qt::QueuedConnection,
+									Q_ARG(bool, done), Q_ARG(bool, saved));
+	});
+	progressTimer->start();
+}
+
+void MainWindow::updateProgress() {
+	const BakeProgress p = core.bakeProgress();
+	if(p.work_total > 0)
+		progressBar->setValue(progressBar->maximum() * p.work_done / p.work_total);
+
+	if(previewChanged) {
+		previewLabel->setPixmap(QPixmap::fromImage(preview));
+		previewChanged = false;
 	}
 
-	core.divideMapByCount();
-	const int w = core.tex_w;
-	const int h = core.tex_h;
-	QImage img{w, h, QImage::Format_RGB888};
-	uchar* img_bits = img.bits();
-	for(int i = 0; i < w; ++i) {
-		for(int j = 0; j < h; ++j) {
-			const int out_idx = 3*(i + (h - j - 1)*w);
-			const int im = i - 1 < 	0 ?     0 : i - 1; // i minus
-			const int ip = i + 1 >= w ? w - 1 : i + 1; // i plus
-			const int jm = j - 1 < 	0 ?     0 : j - 1; // j minus
-			const int jp = j + 1 >= h ? h - 1 : j + 1; // j plus
-
-			const int idx_mm = 3*(im + jm*w);
-			const int idx_0m = 3*(i  + jm*w);
-			const int idx_pm = 3*(ip + jm*w);
-			const int idx_m0 = 3*(im + j *w);
-			const int idx_00 = 3*(i  + j *w);
-			const int idx_p0 = 3*(ip + j *w);
-			const int idx_mp = 3*(im + jp*w);
-			const int idx_0p = 3*(i  + jp*w);
-			const int idx_pp = 3*(ip + jp*w);
-
-			Vec3f blurred = (1/16.0f) * ( 
-				1 * Vec3f{core.tex[idx_mm + 0], core.tex[idx_mm + 1], core.tex[idx_mm + 2]} + 
-				2 * Vec3f{core.tex[idx_0m + 0], core.tex[idx_0m + 1], core.tex[idx_0m + 2]} + 
-				1 * Vec3f{core.tex[idx_pm + 0], core.tex[idx_pm + 1], core.tex[idx_pm + 2]} + 
-				2 * Vec3f{core.tex[idx_m0 + 0], core.tex[idx_m0 + 1], core.tex[idx_m0 + 2]} + 
-				4 * Vec3f{core.tex[idx_00 + 0], core.tex[idx_00 + 1], core.tex[idx_00 + 2]} + 
-				2 * Vec3f{core.tex[idx_p0 + 0], core.tex[idx_p0 + 1], core.tex[idx_p0 + 2]} + 
-				1 * Vec3f{core.tex[idx_mp + 0], core.tex[idx_mp + 1], core.tex[idx_mp + 2]} + 
-				2 * Vec3f{core.tex[idx_0p + 0], core.tex[idx_0p + 1], core.tex[idx_0p + 2]} + 
-				1 * Vec3f{core.tex[idx_pp + 0], core.tex[idx_pp + 1], core.tex[idx_pp + 2]}
-			);
-
-			img_bits[out_idx + 0] = 128 * blurred[0] + 127;
-			img_bits[out_idx + 1] = 128 * blurred[1] + 127;
-			img_bits[out_idx + 2] = 128 * blurred[2] + 127;
-		}
+	QString status = passStatus + QString("%1 Mrays/s").arg(p.elapsed > 0 ? p.rays / p.elapsed * 1e-6 : 0, 0, 'f', 1);
+	if(p.eta >= 0) {
+		const int eta = std::lround(p.eta);
+		status += QString(", ETA %1:%2").arg(eta / 60).arg(eta % 60, 2, 10, QChar('0'));
 	}
-	img.save(outFilePath);
+	statusLabel->setText(status);
+}
+
+void MainWindow::passFinished(QImage img, int passesDone, int passesTotal) {
+	preview = img;
+	previewChanged = true;
+	passStatus = QString("Pass %1 of %2, ").arg(passesDone).arg(passesTotal);
+}
 
-	progressBar->setValue(progressBar->maximum());
+void MainWindow::bakeFinished(bool done, bool saved) {
+	progressTimer->stop();
+	updateProgress();
+	core.waitBake();
+	baking = false;
+
+	const BakeProgress p = core.bakeProgress();
+	if(!done)
+		statusLabel->setText("Bake cancelled");
+	else if(!saved)
+		statusLabel->setText("Cannot save " + outFilePath);
+	else
+		statusLabel->setText(QString("Baked in %1s, %2 Mrays/s")
+			.arg(p.elapsed, 0, 'f', 1)
+			.arg(p.elapsed > 0 ? p.rays / p.elapsed * 1e-6 : 0, 0, 'f', 1));
+
+	if(done) progressBar->setValue(progressBar->maximum());
 	startBakingBtn->setText("Start baking");
 	unlockButtons();
 }
@@ -213,6 +279,8 @@ void MainWindow::lockButtons() {
 	lowPolyFileLabel->setEnabled(false);
 	highPolyFileLabel->setEnabled(false);
 	mapSizeCombo->setEnabled(false);
+	threadsSpin->setEnabled(false);
+	progressiveCheck->setEnabled(false);
 	outFileFileLabel->setEnabled(false);
 	startBakingBtn->setEnabled(false);
 };
@@ -225,5 +293,7 @@ void MainWindow::unlockButtons() {
 	lowPolyFileLabel->setEnabled(true);
 	highPolyFileLabel->setEnabled(true);
 	mapSizeCombo->setEnabled(true);
+	threadsSpin->setEnabled(true);
+	progressiveCheck->setEnabled(true);
 	outFileFileLabel->setEnabled(true);
 };
@@ -16,10 +16,13 @@ public slots:
 	void loadLowObj();
 	void selectOutFile();
 	void setMapSize(QString);
+	void setThreadsNum(int);
 	void generateMap();
 
-signals:
-	void startMapGenerationSig();
+private slots:
+	void updateProgress();
+	void bakeFinished(bool done, bool saved);
+	void passFinished(QImage preview, int passesDone, int passesTotal);
 
 private:
 	QPushButton*	lowPolyLoadBtn;
@@ -29,14 +32,24 @@ private:
 	QLineEdit*		highPolyFileLabel;
 	QLineEdit*		outFileFileLabel;
 	QComboBox*		mapSizeCombo;
+	QSpinBox*		threadsSpin;
+	QCheckBox*		progressiveCheck;
 	QPushButton*	startBakingBtn;
 	QProgressBar*	progressBar;
+	QLabel*			statusLabel;
+	QTimer*			progressTimer;
+	QLabel*			previewLabel;
+
+	// Latest progressive pass, shown on the next timer tick
+	QImage			preview;
+	bool			previewChanged;
+	QString			passStatus;
 
 	Core 			core;
-	QThread*		workerThread;
 
 	QString			outFilePath;
 	bool lowPolyLoaded, highPolyLoaded;
+	bool baking;
 
 	void checkBakingRequirements();
 	void lockButtons();
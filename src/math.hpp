@@ -3,6 +3,7 @@
 
 #include <array>
 #include <cmath>
+#include <cstdint>
 #include <iostream>
 
 #define PI 3.141592654f
@@ -134,4 +135,33 @@ inline const float triarea(const Vec2f p0, const Vec2f p1, const Vec2f p2) {
 }
 
 
+//////// NORMAL ENCODING ////////
+
+// Octahedral encoding of a unit vector in two 16 bit fixed point values
+inline const uint32_t octEncode(const Vec3f& n) {
+	const float l1 = std::abs(n[0]) + std::abs(n[1]) + std::abs(n[2]);
+	float x = n[0] / l1;
+	float y = n[1] / l1;
+	if(n[2] < 0) {
+		const float ox = x;
+		x = (1 - std::abs(y))  * (ox >= 0 ? 1 : -1);
+		y = (1 - std::abs(ox)) * (y  >= 0 ? 1 : -1);
+	}
+	const uint32_t ex = std::lround((x * 0.5f + 0.5f) * 65535);
+	const uint32_t ey = std::lround((y * 0.5f + 0.5f) * 65535);
+	return ex | (ey << 16);
+}
+
+inline const Vec3f octDecode(const uint32_t e) {
+	float x = (e & 0xFFFF) / 65535.0f * 2 - 1;
+	float y = (e >> 16)    / 65535.0f * 2 - 1;
+	const float z = 1 - std::abs(x) - std::abs(y);
+	if(z < 0) {
+		const float ox = x;
+		x = (1 - std::abs(y))  * (ox >= 0 ? 1 : -1);
+		y = (1 - std::abs(ox)) * (y  >= 0 ? 1 : -1);
+	}
+	return normalize({x, y, z});
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,422 @@
+#include "mesh.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+
+#include <xmmintrin.h>
+
+#include <sys/stat.h>
+
+#ifdef _WIN32
+	#define NOMINMAX
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <unistd.h>
+#endif
+
+#include "parallel.hpp"
+
+// Arrays in the cache file start on this boundary. The file ends with as
+// many zero bytes, so SIMD loads past the last element stay in the mapping.
+#define MESH_CACHE_ALIGN 64
+
+// Elements per job of the parallel loops of generateNormals
+#define NORMALS_BLOCK_SIZE 16384
+
+namespace {
+
+struct CacheHeader {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	path_size;		// Source path bytes, stored right after the header
+	uint64_t	source_size;
+	int64_t		source_mtime;
+	uint64_t	vnum, nnum, uvnum, trinum;
+	uint64_t	offsets[6];		// pos, nrm, uv, pos_idx, nrm_idx, uv_idx
+	uint64_t	file_size;
+	int32_t		generated_normals;
+	uint32_t	reserved;
+};
+
+const char cache_magic[8] = {'B', 'K', 'M', 'E', 'S', 'H', 0, 0};
+
+uint64_t alignUp(const uint64_t x) {
+	return (x + MESH_CACHE_ALIGN - 1) / MESH_CACHE_ALIGN * MESH_CACHE_ALIGN;
+}
+
+bool sourceStat(const std::string& source_file, uint64_t& size, int64_t& mtime) {
+	struct stat st;
+	if(stat(source_file.c_str(), &st) != 0) return false;
+	size = st.st_size;
+	mtime = st.st_mtime;
+	return true;
+}
+
+// Fills the header offsets and returns the file size
+uint64_t layout(CacheHeader& h) {
+	const uint64_t sizes[6] = {	3*h.vnum*sizeof(float), 3*h.nnum*sizeof(float), 2*h.uvnum*sizeof(float),
+								3*h.trinum*sizeof(uint32_t), 3*h.trinum*sizeof(uint32_t), 3*h.trinum*sizeof(uint32_t)};
+	uint64_t offset = alignUp(sizeof(CacheHeader) + h.path_size);
+	for(int a = 0; a < 6; ++a) {
+		h.offsets[a] = offset;
+		offset = alignUp(offset + sizes[a]);
+	}
+	return offset + MESH_CACHE_ALIGN;
+}
+
+}
+
+std::string meshCachePath(const std::string& source_file) {
+	return source_file + ".bkmesh";
+}
+
+MappedFile::MappedFile() : data{nullptr}, size{0} {
+}
+
+MappedFile::~MappedFile() {
+	close();
+}
+
+bool MappedFile::open(const std::string& filename) {
+	close();
+
+	#ifdef _WIN32
+		HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+									OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if(file == INVALID_HANDLE_VALUE) return false;
+		LARGE_INTEGER file_size;
+		GetFileSizeEx(file, &file_size);
+		HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		CloseHandle(file);
+		if(!mapping) return false;
+		void* addr = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		CloseHandle(mapping);
+		if(!addr) return false;
+		size = file_size.QuadPart;
+	#else
+		const int fd = ::open(filename.c_str(), O_RDONLY);
+		if(fd < 0) return false;
+		struct stat st;
+		if(fstat(fd, &st) != 0 || st.st_size == 0) {
+			::close(fd);
+			return false;
+		}
+		void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		::close(fd);
+		if(addr == MAP_FAILED) return false;
+		size = st.st_size;
+	#endif
+
+	data = static_cast<const char*>(addr);
+	return true;
+}
+
+void MappedFile::close() {
+	if(!data) return;
+	#ifdef _WIN32
+		UnmapViewOfFile(data);
+	#else
+		munmap(const_cast<char*>(data), size);
+	#endif
+	data = nullptr;
+	size = 0;
+}
+
+Mesh::Mesh() {
+	clear();
+}
+
+Mesh::~Mesh() {
+}
+
+void Mesh::clear() {
+	mapping.close();
+	pos_data		= {};
+	nrm_data		= {};
+	uv_data			= {};
+	pos_idx_data	= {};
+	nrm_idx_data	= {};
+	uv_idx_data		= {};
+	vnum = nnum = uvnum = trinum = 0;
+	generated_normals = -1;
+	pointToData();
+}
+
+void Mesh::releasePositions() {
+	pos_data		= {};
+	pos_idx_data	= {};
+	pos		= nullptr;
+	pos_idx	= nullptr;
+}
+
+void Mesh::releaseNormals() {
+	nrm_data		= {};
+	nrm		= nullptr;
+}
+
+void Mesh::releaseNormalIndices() {
+	nrm_idx_data	= {};
+	nrm_idx	= nullptr;
+}
+
+void Mesh::pointToData() {
+	pos		= pos_data.data();
+	nrm		= nrm_data.data();
+	uv		= uv_data.data();
+	pos_idx	= pos_idx_data.data();
+	nrm_idx	= nrm_idx_data.data();
+	uv_idx	= uvnum > 0 ? uv_idx_data.data() : nullptr;
+}
+
+void Mesh::assign(const tinyobj::attrib_t& attrib, const tinyobj::shape_t& shape) {
+	clear();
+
+	pos_data	= attrib.vertices;
+	nrm_data	= attrib.normals;
+	// Embree reads the last vertex with a 16 byte load
+	pos_data.reserve(pos_data.size() + 1);
+	uv_data		= attrib.texcoords;
+	vnum	= pos_data.size() / 3;
+	nnum	= nrm_data.size() / 3;
+	uvnum	= uv_data.size() / 2;
+	trinum	= shape.mesh.indices.size() / 3;
+
+	pos_idx_data.resize(3*trinum);
+	nrm_idx_data.resize(3*trinum);
+	uv_idx_data.resize(3*trinum);
+	bool missing_normals = false;
+	for(size_t c = 0; c < 3*trinum; ++c) {
+		pos_idx_data[c]	= shape.mesh.indices[c].vertex_index;
+		nrm_idx_data[c]	= shape.mesh.indices[c].normal_index;
+		uv_idx_data[c]	= shape.mesh.indices[c].texcoord_index;
+		missing_normals |= nrm_idx_data[c] >= nnum;
+	}
+	// Corners without a valid normal have no sensible one to borrow, all are generated instead
+	if(missing_normals) {
+		nrm_data.clear();
+		nnum = 0;
+	}
+
+	pointToData();
+}
+
+void Mesh::assign(	std::vector<float>&& positions, std::vector<float>&& normals, std::vector<float>&& texcoords,
+					std::vector<uint32_t>&& position_idx, std::vector<uint32_t>&& normal_idx,
+					std::vector<uint32_t>&& texcoord_idx) {
+	clear();
+
+	pos_data		= std::move(positions);
+	nrm_data		= std::move(normals);
+	uv_data			= std::move(texcoords);
+	pos_idx_data	= std::move(position_idx);
+	nrm_idx_data	= normal_idx.empty() ? pos_idx_data : std::move(normal_idx);
+	uv_idx_data		= std::move(texcoord_idx);
+	pos_data.reserve(pos_data.size() + 1);
+	vnum	= pos_data.size() / 3;
+	nnum	= nrm_data.size() / 3;
+	uvnum	= uv_data.size() / 2;
+	trinum	= pos_idx_data.size() / 3;
+	uv_idx_data.resize(3*trinum, (uint32_t)-1);
+
+	pointToData();
+}
+
+void Mesh::generateNormals(const NormalWeighting weighting, const int threads_num) {
+	const size_t corners = 3*trinum;
+
+	// Unnormalized face normals, their length is twice the face area
+	std::vector<Vec3f> face_n(trinum);
+	parallelForRange(trinum, NORMALS_BLOCK_SIZE, threads_num, [&](const size_t begin, const size_t end) {
+		for(size_t ti = begin; ti < end; ++ti) {
+			const Vec3f p0{position(pos_idx[3*ti + 0])};
+			face_n[ti] = cross(position(pos_idx[3*ti + 1]) - p0, position(pos_idx[3*ti + 2]) - p0);
+		}
+	});
+
+	// Vertex to corner adjacency in CSR form: the corners of vertex vi are
+	// adj[first[vi]] ... adj[first[vi + 1] - 1]
+	std::unique_ptr<std::atomic<uint32_t>[]> fill(new std::atomic<uint32_t>[vnum]());
+	parallelForRange(corners, NORMALS_BLOCK_SIZE, threads_num, [&](const size_t begin, const size_t end) {
+		for(size_t c = begin; c < end; ++c)
+			fill[pos_idx[c]].fetch_add(1, std::memory_order_relaxed);
+	});
+	std::vector<uint32_t> first(vnum + 1);
+	first[0] = 0;
+	for(size_t vi = 0; vi < vnum; ++vi) {
+		first[vi + 1] = first[vi] + fill[vi].load(std::memory_order_relaxed);
+		fill[vi].store(first[vi], std::memory_order_relaxed);
+	}
+	std::vector<uint32_t> adj(corners);
+	parallelForRange(corners, NORMALS_BLOCK_SIZE, threads_num, [&](const size_t begin, const size_t end) {
+		for(size_t c = begin; c < end; ++c)
+			adj[fill[pos_idx[c]].fetch_add(1, std::memory_order_relaxed)] = c;
+	});
+	fill.reset();
+
+	// Each vertex gathers its own faces, so no two threads write the same sum.
+	// The corners are sorted first, which makes the sums independent of the fill order.
+	// Sums go to separate x, y and z arrays padded to a multiple of 4 for the normalize pass.
+	const size_t padded = (vnum + 3) & ~size_t(3);
+	std::vector<float> sum_x(padded, 0), sum_y(padded, 0), sum_z(padded, 0);
+	parallelForRange(vnum, NORMALS_BLOCK_SIZE, threads_num, [&](const size_t begin, const size_t end) {
+		for(size_t vi = begin; vi < end; ++vi) {
+			std::sort(adj.begin() + first[vi], adj.begin() + first[vi + 1]);
+			Vec3f n{0, 0, 0};
+			for(uint32_t a = first[vi]; a < first[vi + 1]; ++a) {
+				const uint32_t c = adj[a];
+				const Vec3f& fn = face_n[c / 3];
+				const float len = length(fn);
+				if(len == 0) continue;
+
+				float w = 1 / len;
+				if(weighting == NORMAL_WEIGHT_AREA) {
+					w = 1;
+				} else if(weighting == NORMAL_WEIGHT_ANGLE) {
+					const uint32_t tri = c - c % 3;
+					const Vec3f p{position(pos_idx[c])};
+					const Vec3f e1{position(pos_idx[tri + (c + 1) % 3]) - p};
+					const Vec3f e2{position(pos_idx[tri + (c + 2) % 3]) - p};
+					w *= std::atan2(length(cross(e1, e2)), dot(e1, e2));
+				}
+				n = n + w*fn;
+			}
+			sum_x[vi] = n[0];
+			sum_y[vi] = n[1];
+			sum_z[vi] = n[2];
+		}
+	});
+
+	// Normalize 4 vertices at a time. Vertices of no face, or of degenerate faces only, get a zero normal.
+	nrm_data.resize(3*vnum);
+	parallelForRange(padded, NORMALS_BLOCK_SIZE, threads_num, [&](const size_t begin, const size_t end) {
+		for(size_t vi = begin; vi < end; vi += 4) {
+			__m128 x = _mm_loadu_ps(&sum_x[vi]);
+			__m128 y = _mm_loadu_ps(&sum_y[vi]);
+			__m128 z = _mm_loadu_ps(&sum_z[vi]);
+			const __m128 len2 = _mm_add_ps(_mm_mul_ps(x, x), _mm_add_ps(_mm_mul_ps(y, y), _mm_mul_ps(z, z)));
+			const __m128 inv = _mm_and_ps(	_mm_cmpgt_ps(len2, _mm_setzero_ps()),
+											_mm_div_ps(_mm_set1_ps(1), _mm_sqrt_ps(len2)));
+			x = _mm_mul_ps(x, inv);
+			y = _mm_mul_ps(y, inv);
+			z = _mm_mul_ps(z, inv);
+
+			alignas(16) float out[3][4];
+			_mm_store_ps(out[0], x);
+			_mm_store_ps(out[1], y);
+			_mm_store_ps(out[2], z);
+			for(size_t k = 0; k < 4 && vi + k < vnum; ++k) {
+				nrm_data[3*(vi + k) + 0] = out[0][k];
+				nrm_data[3*(vi + k) + 1] = out[1][k];
+				nrm_data[3*(vi + k) + 2] = out[2][k];
+			}
+		}
+	});
+
+	nrm_idx_data.assign(pos_idx, pos_idx + corners);
+	nnum = vnum;
+	generated_normals = weighting;
+	pointToData();
+}
+
+bool Mesh::writeCache(const std::string& cache_file, const std::string& source_file) const {
+	CacheHeader h{};
+	std::memcpy(h.magic, cache_magic, 8);
+	h.version	= MESH_CACHE_VERSION;
+	h.path_size	= source_file.size();
+	if(!sourceStat(source_file, h.source_size, h.source_mtime)) return false;
+	h.vnum		= vnum;
+	h.nnum		= nnum;
+	h.uvnum		= uvnum;
+	h.trinum	= trinum;
+	h.file_size	= layout(h);
+	h.generated_normals = generated_normals;
+
+	// Written under a temporary name so a reader never maps a partial file
+	const std::string tmp_file = cache_file + ".tmp";
+	FILE* f = fopen(tmp_file.c_str(), "wb");
+	if(!f) return false;
+
+	const void* arrays[6]	= {pos, nrm, uv, pos_idx, nrm_idx, uv_idx};
+	const uint64_t sizes[6]	= {	3*vnum*sizeof(float), 3*nnum*sizeof(float), 2*uvnum*sizeof(float),
+								3*trinum*sizeof(uint32_t), 3*trinum*sizeof(uint32_t),
+								uv_idx ? 3*trinum*sizeof(uint32_t) : 0};
+	const char zeros[MESH_CACHE_ALIGN] = {};
+
+	uint64_t written = 0;
+	const auto put = [&](const void* data, const uint64_t size) {
+		if(size > 0) fwrite(data, 1, size, f);
+		written += size;
+	};
+	const auto padTo = [&](const uint64_t offset) {
+		while(written < offset) put(zeros, std::min<uint64_t>(MESH_CACHE_ALIGN, offset - written));
+	};
+
+	put(&h, sizeof(h));
+	put(source_file.data(), source_file.size());
+	for(int a = 0; a < 6; ++a) {
+		padTo(h.offsets[a]);
+		put(arrays[a], sizes[a]);
+	}
+	padTo(h.file_size);
+
+	const bool ok = !ferror(f);
+	fclose(f);
+
+	std::remove(cache_file.c_str());
+	if(!ok || std::rename(tmp_file.c_str(), cache_file.c_str()) != 0) {
+		std::remove(tmp_file.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool Mesh::mapCache(const std::string& cache_file, const std::string& source_file) {
+	uint64_t source_size;
+	int64_t source_mtime;
+	if(!sourceStat(source_file, source_size, source_mtime)) return false;
+
+	clear();
+	if(!mapping.open(cache_file)) return false;
+
+	const char* base = mapping.data;
+	CacheHeader h;
+	bool valid = mapping.size >= sizeof(CacheHeader);
+	if(valid) {
+		std::memcpy(&h, base, sizeof(h));
+		valid =	std::memcmp(h.magic, cache_magic, 8) == 0 &&
+				h.version		== MESH_CACHE_VERSION &&
+				h.source_size	== source_size &&
+				h.source_mtime	== source_mtime &&
+				h.path_size		== source_file.size() &&
+				h.file_size		== mapping.size &&
+				std::memcmp(base + sizeof(h), source_file.data(), h.path_size) == 0;
+	}
+	if(valid) {
+		// The offsets are recomputed from the counts, so a corrupted header cannot point outside the file
+		CacheHeader check = h;
+		valid = layout(check) == h.file_size && std::memcmp(check.offsets, h.offsets, sizeof(h.offsets)) == 0;
+	}
+	if(!valid) {
+		mapping.close();
+		return false;
+	}
+
+	vnum	= h.vnum;
+	nnum	= h.nnum;
+	uvnum	= h.uvnum;
+	trinum	= h.trinum;
+	generated_normals = h.generated_normals;
+	pos		= reinterpret_cast<const float*>	(base + h.offsets[0]);
+	nrm		= reinterpret_cast<const float*>	(base + h.offsets[1]);
+	uv		= reinterpret_cast<const float*>	(base + h.offsets[2]);
+	pos_idx	= reinterpret_cast<const uint32_t*>	(base + h.offsets[3]);
+	nrm_idx	= reinterpret_cast<const uint32_t*>	(base + h.offsets[4]);
+	uv_idx	= uvnum > 0 ? reinterpret_cast<const uint32_t*>(base + h.offsets[5]) : nullptr;
+	return true;
+}
@@ -0,0 +1,101 @@
+#ifndef _MESH_HPP_
+#define _MESH_HPP_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "tiny_obj_loader.h"
+
+#include "math.hpp"
+
+// Version of the binary mesh cache layout. Bump on every change.
+#define MESH_CACHE_VERSION 2
+
+// How the face normals around a vertex are weighted when generating vertex normals
+enum NormalWeighting {
+	NORMAL_WEIGHT_UNIFORM,		// Plain average
+	NORMAL_WEIGHT_AREA,			// By face area
+	NORMAL_WEIGHT_ANGLE			// By the face angle at the vertex
+};
+
+// Read-only mapping of a whole file
+class MappedFile {
+public:
+	MappedFile();
+	~MappedFile();
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool open(const std::string& filename);
+	void close();
+
+	const char*	data;
+	size_t		size;
+};
+
+// Flat triangle mesh. Every triangle corner has a position, a normal and
+// a UV index. The arrays either live in the mesh or in a read-only
+// mapping of a cache file.
+class Mesh {
+public:
+	Mesh();
+	~Mesh();
+	Mesh(const Mesh&) = delete;
+	Mesh& operator=(const Mesh&) = delete;
+
+	// Copies a tinyobj shape into flat arrays
+	void assign(const tinyobj::attrib_t& attrib, const tinyobj::shape_t& shape);
+	// Takes ownership of already flat arrays. Empty nrm_idx means the normals are per position.
+	void assign(std::vector<float>&& positions, std::vector<float>&& normals, std::vector<float>&& texcoords,
+				std::vector<uint32_t>&& position_idx, std::vector<uint32_t>&& normal_idx,
+				std::vector<uint32_t>&& texcoord_idx);
+
+	// Averages the face normals around each position on threads_num threads (0 means one
+	// per core). Normal indices become the position indices.
+	void generateNormals(const NormalWeighting weighting, const int threads_num);
+
+	// Maps cache_file if it was written for source_file in its current state
+	bool mapCache(const std::string& cache_file, const std::string& source_file);
+	bool writeCache(const std::string& cache_file, const std::string& source_file) const;
+
+	// Free arrays once they are stored elsewhere. Their pointers become null.
+	void releasePositions();		// Positions and position indices
+	void releaseNormals();			// Normals only
+	void releaseNormalIndices();
+
+	void clear();
+	bool isMapped() const { return mapping.data != nullptr; }
+
+	Vec3f position(const uint32_t vi) const { return {pos[3*vi + 0], pos[3*vi + 1], pos[3*vi + 2]}; }
+	Vec3f normal  (const uint32_t ni) const { return {nrm[3*ni + 0], nrm[3*ni + 1], nrm[3*ni + 2]}; }
+	Vec2f texcoord(const uint32_t ti) const { return {uv[2*ti + 0], uv[2*ti + 1]}; }
+
+	size_t vnum, nnum, uvnum, trinum;
+
+	// Weighting the normals were generated with, -1 if they come from the file
+	int generated_normals;
+
+	// xyz positions and normals, uv pairs
+	const float* pos;
+	const float* nrm;
+	const float* uv;
+
+	// Three indices per triangle. uv_idx is null if the mesh has no UVs.
+	const uint32_t* pos_idx;
+	const uint32_t* nrm_idx;
+	const uint32_t* uv_idx;
+
+private:
+	std::vector<float>		pos_data, nrm_data, uv_data;
+	std::vector<uint32_t>	pos_idx_data, nrm_idx_data, uv_idx_data;
+
+	MappedFile mapping;
+
+	void pointToData();
+};
+
+// Name of the cache file of an OBJ
+std::string meshCachePath(const std::string& source_file);
+
+#endif
@@ -0,0 +1,324 @@
+#include "objLoader.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+#include "parallel.hpp"
+
+#ifdef _WIN32
+	#define NOMINMAX
+	#include <windows.h>
+	#include <psapi.h>
+#else
+	#include <sys/resource.h>
+#endif
+
+// Chunks per thread, so that threads finishing early can take more work
+#define OBJ_CHUNKS_PER_THREAD 8
+
+namespace {
+
+struct Chunk {
+	const char* begin;
+	const char* end;
+
+	// Elements in the chunk
+	size_t v, vn, vt, tris;
+
+	// Elements before the chunk
+	size_t v_first, vn_first, vt_first, tri_first;
+};
+
+inline bool isBlank(const char c) {
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+inline const char* skipBlanks(const char* p, const char* end) {
+	while(p < end && isBlank(*p)) ++p;
+	return p;
+}
+
+inline const char* lineEnd(const char* p, const char* end) {
+	while(p < end && *p != '\n') ++p;
+	return p;
+}
+
+// Fast float parser, no locale and no error reporting
+inline const char* parseFloat(const char* p, const char* end, float& out) {
+	p = skipBlanks(p, end);
+	bool neg = false;
+	if(p < end && (*p == '-' || *p == '+')) neg = *p++ == '-';
+
+	uint64_t mant = 0;
+	int exp = 0, digits = 0;
+	for(; p < end && *p >= '0' && *p <= '9'; ++p) {
+		if(digits < 19) { mant = mant*10 + (*p - '0'); ++digits; }
+		else ++exp;
+	}
+	if(p < end && *p == '.') {
+		for(++p; p < end && *p >= '0' && *p <= '9'; ++p) {
+			if(digits < 19) { mant = mant*10 + (*p - '0'); ++digits; --exp; }
+		}
+	}
+	if(p < end && (*p == 'e' || *p == 'E')) {
+		++p;
+		bool eneg = false;
+		if(p < end && (*p == '-' || *p == '+')) eneg = *p++ == '-';
+		int e = 0;
+		for(; p < end && *p >= '0' && *p <= '9'; ++p)
+			e = std::min(e*10 + (*p - '0'), 10000);
+		exp += eneg ? -e : e;
+	}
+
+	const double v = exp == 0 ? (double)mant : (double)mant * std::pow(10.0, exp);
+	out = neg ? -v : v;
+	return p;
+}
+
+inline const char* parseInt(const char* p, const char* end, long long& out) {
+	bool neg = false;
+	if(p < end && (*p == '-' || *p == '+')) neg = *p++ == '-';
+	long long v = 0;
+	for(; p < end && *p >= '0' && *p <= '9'; ++p)
+		v = v*10 + (*p - '0');
+	out = neg ? -v : v;
+	return p;
+}
+
+// Parses one face corner "v", "v/t", "v//n" or "v/t/n". Missing indices are 0.
+inline const char* parseCorner(const char* p, const char* end, long long idx[3]) {
+	idx[0] = idx[1] = idx[2] = 0;
+	p = parseInt(p, end, idx[0]);
+	for(int k = 1; k < 3 && p < end && *p == '/'; ++k) {
+		++p;
+		if(p < end && *p != '/') p = parseInt(p, end, idx[k]);
+	}
+	return p;
+}
+
+inline int countCorners(const char* p, const char* end) {
+	int n = 0;
+	while(true) {
+		p = skipBlanks(p, end);
+		if(p >= end || *p == '\n' || *p == '#') return n;
+		++n;
+		while(p < end && !isBlank(*p) && *p != '\n') ++p;
+	}
+}
+
+// Line kinds
+enum { LINE_OTHER, LINE_V, LINE_VN, LINE_VT, LINE_F };
+
+inline int lineKind(const char* p, const char* end) {
+	if(end - p < 2) return LINE_OTHER;
+	if(p[0] == 'v') {
+		if(isBlank(p[1]))						return LINE_V;
+		if(end - p < 3 || !isBlank(p[2]))		return LINE_OTHER;
+		if(p[1] == 'n')							return LINE_VN;
+		if(p[1] == 't')							return LINE_VT;
+	} else if(p[0] == 'f' && isBlank(p[1]))	{
+		return LINE_F;
+	}
+	return LINE_OTHER;
+}
+
+void countChunk(Chunk& c) {
+	c.v = c.vn = c.vt = c.tris = 0;
+	for(const char* p = c.begin; p < c.end; ) {
+		p = skipBlanks(p, c.end);
+		const char* e = lineEnd(p, c.end);
+		switch(lineKind(p, e)) {
+			case LINE_V:	++c.v; break;
+			case LINE_VN:	++c.vn; break;
+			case LINE_VT:	++c.vt; break;
+			case LINE_F: {
+				const int corners = countCorners(p + 1, e);
+				if(corners >= 3) c.tris += corners - 2;
+				break;
+			}
+		}
+		p = e + 1;
+	}
+}
+
+// Turns an OBJ index, 1-based or negative relative, into a 0-based one. -1 if missing.
+inline uint32_t resolve(const long long idx, const size_t defined) {
+	if(idx > 0) return idx - 1;
+	if(idx < 0) return defined + idx;
+	return (uint32_t)-1;
+}
+
+struct Output {
+	std::vector<float>		pos, nrm, uv;
+	std::vector<uint32_t>	pos_idx, nrm_idx, uv_idx;
+};
+
+void parseChunk(const Chunk& c, Output& out) {
+	size_t v = c.v_first, vn = c.vn_first, vt = c.vt_first, tri = c.tri_first;
+
+	for(const char* p = c.begin; p < c.end; ) {
+		p = skipBlanks(p, c.end);
+		const char* e = lineEnd(p, c.end);
+		switch(lineKind(p, e)) {
+			case LINE_V: {
+				const char* q = p + 1;
+				for(int k = 0; k < 3; ++k) q = parseFloat(q, e, out.pos[3*v + k]);
+				++v;
+				break;
+			}
+			case LINE_VN: {
+				const char* q = p + 2;
+				for(int k = 0; k < 3; ++k) q = parseFloat(q, e, out.nrm[3*vn + k]);
+				++vn;
+				break;
+			}
+			case LINE_VT: {
+				const char* q = p + 2;
+				for(int k = 0; k < 2; ++k) q = parseFloat(q, e, out.uv[2*vt + k]);
+				++vt;
+				break;
+			}
+			case LINE_F: {
+				uint32_t first[3], prev[3];
+				int corner = 0;
+				const char* q = p + 1;
+				while(true) {
+					q = skipBlanks(q, e);
+					if(q >= e || *q == '#') break;
+
+					long long idx[3];
+					q = parseCorner(q, e, idx);
+					while(q < e && !isBlank(*q)) ++q;
+					const uint32_t cur[3] = {resolve(idx[0], v), resolve(idx[2], vn), resolve(idx[1], vt)};
+
+					if(corner == 0) {
+						std::copy(cur, cur + 3, first);
+					} else if(corner >= 2) {
+						// Fan triangulation
+						const uint32_t* tri_corners[3] = {first, prev, cur};
+						for(int k = 0; k < 3; ++k) {
+							out.pos_idx[3*tri + k]	= tri_corners[k][0];
+							out.nrm_idx[3*tri + k]	= tri_corners[k][1];
+							out.uv_idx [3*tri + k]	= tri_corners[k][2];
+						}
+						++tri;
+					}
+					std::copy(cur, cur + 3, prev);
+					++corner;
+				}
+				break;
+			}
+		}
+		p = e + 1;
+	}
+}
+
+}
+
+size_t peakRssBytes() {
+	#ifdef _WIN32
+		PROCESS_MEMORY_COUNTERS pmc;
+		if(GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+			return pmc.PeakWorkingSetSize;
+		return 0;
+	#else
+		struct rusage usage;
+		if(getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+		#ifdef __APPLE__
+			return usage.ru_maxrss;
+		#else
+			return (size_t)usage.ru_maxrss * 1024;
+		#endif
+	#endif
+}
+
+bool loadObjParallel(	const std::string&	filename,
+						Mesh&				mesh,
+						const int			threads_num,
+						ObjLoadStats&		stats) {
+
+	const auto start = std::chrono::steady_clock::now();
+	stats = ObjLoadStats{};
+
+	MappedFile file;
+	if(!file.open(filename)) {
+		std::cerr << "Cannot open " << filename << std::endl;
+		return false;
+	}
+	stats.bytes = file.size;
+
+	const int n = threadsFor(threads_num);
+
+	// Chunks end right after a newline, so no line is split
+	const char* const data_end = file.data + file.size;
+	const size_t chunk_size = std::max<size_t>(1 << 20, file.size / (n*OBJ_CHUNKS_PER_THREAD) + 1);
+	std::vector<Chunk> chunks;
+	for(const char* p = file.data; p < data_end; ) {
+		const char* e = p + std::min<size_t>(chunk_size, data_end - p);
+		e = std::min(data_end, lineEnd(e, data_end) + 1);
+		Chunk c{};
+		c.begin = p;
+		c.end = e;
+		chunks.push_back(c);
+		p = e;
+	}
+
+	parallelFor(chunks.size(), n, [&](size_t ci) { countChunk(chunks[ci]); });
+
+	size_t v = 0, vn = 0, vt = 0, tris = 0;
+	for(Chunk& c : chunks) {
+		c.v_first = v;		v += c.v;
+		c.vn_first = vn;	vn += c.vn;
+		c.vt_first = vt;	vt += c.vt;
+		c.tri_first = tris;	tris += c.tris;
+	}
+	const auto scanned = std::chrono::steady_clock::now();
+	stats.scan_time = std::chrono::duration<double>(scanned - start).count();
+
+	if(tris == 0 || v == 0) {
+		std::cerr << filename << " has no faces" << std::endl;
+		return false;
+	}
+
+	Output out;
+	out.pos.resize(3*v);
+	out.nrm.resize(3*vn);
+	out.uv.resize(2*vt);
+	out.pos_idx.resize(3*tris);
+	out.nrm_idx.resize(3*tris);
+	out.uv_idx.resize(3*tris);
+
+	parallelFor(chunks.size(), n, [&](size_t ci) { parseChunk(chunks[ci], out); });
+
+	// Faces without UVs get an invalid index
+	bool bad_index = false;
+	size_t missing_normals = 0;
+	for(size_t c = 0; c < 3*tris; ++c) {
+		bad_index |= out.pos_idx[c] >= v;
+		missing_normals += out.nrm_idx[c] >= vn;
+		if(out.uv_idx[c] >= vt) out.uv_idx[c] = (uint32_t)-1;
+	}
+	if(bad_index) {
+		std::cerr << filename << " has out of range vertex indices" << std::endl;
+		return false;
+	}
+
+	// A corner without a valid normal has no sensible one to borrow, so the file
+	// normals are dropped and the caller generates vertex normals for the whole mesh
+	if(vn > 0 && missing_normals > 0) {
+		std::cerr << filename << ": " << missing_normals
+				<< " face corners have no valid normal, generating vertex normals" << std::endl;
+		out.nrm.clear();
+		vn = 0;
+	}
+	if(vn == 0) out.nrm_idx.clear();
+	mesh.assign(std::move(out.pos), std::move(out.nrm), std::move(out.uv),
+				std::move(out.pos_idx), std::move(out.nrm_idx), std::move(out.uv_idx));
+
+	stats.parse_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - scanned).count();
+	stats.peak_rss = peakRssBytes();
+	return true;
+}
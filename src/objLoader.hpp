@@ -0,0 +1,29 @@
+#ifndef _OBJ_LOADER_HPP_
+#define _OBJ_LOADER_HPP_
+
+#include <string>
+
+#include "mesh.hpp"
+
+struct ObjLoadStats {
+	double	scan_time;		// Counting pass, seconds
+	double	parse_time;		// Parsing pass, seconds
+	size_t	bytes;			// Size of the OBJ file
+	size_t	peak_rss;		// Process peak resident set after loading, bytes
+};
+
+// Parses an OBJ file on threads_num threads (0 means one per core) straight
+// into the flat mesh arrays. The file is split in chunks at line boundaries:
+// a first pass counts the elements of every chunk, a second one parses them
+// into their final place, resolving relative indices with the counts of the
+// previous chunks. Polygons are fan triangulated. All the faces of the file
+// are loaded, regardless of objects and groups.
+bool loadObjParallel(	const std::string&	filename,
+						Mesh&				mesh,
+						const int			threads_num,
+						ObjLoadStats&		stats);
+
+// Peak resident set size of the process in bytes, 0 if unknown
+size_t peakRssBytes();
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef _PARALLEL_HPP_
+#define _PARALLEL_HPP_
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <vector>
+
+// Number of threads to use for a requested count. 0 means one per hardware thread.
+inline int threadsFor(const int threads_num) {
+	const int n = threads_num > 0 ? threads_num : std::thread::hardware_concurrency();
+	return n < 1 ? 1 : n;
+}
+
+// Runs job(0) ... job(jobs - 1) on threads_num threads, the calling one included.
+// Threads take the next job from a shared counter until none is left.
+inline void parallelFor(const size_t jobs, const int threads_num, const std::function<void(size_t)>& job) {
+	std::atomic<size_t> next{0};
+	const auto worker = [&]() {
+		for(size_t j = next++; j < jobs; j = next++) job(j);
+	};
+
+	const int n = std::min<size_t>(threadsFor(threads_num), std::max<size_t>(jobs, 1));
+	std::vector<std::thread> threads;
+	for(int i = 1; i < n; ++i)
+		threads.emplace_back(worker);
+	worker();
+	for(auto& th : threads)
+		th.join();
+}
+
+// Runs job(begin, end) over [0, size) split in blocks of block_size elements
+inline void parallelForRange(	const size_t size, const size_t block_size, const int threads_num,
+								const std::function<void(size_t, size_t)>& job) {
+	const size_t blocks = (size + block_size - 1) / block_size;
+	parallelFor(blocks, threads_num, [&](const size_t b) {
+		job(b*block_size, std::min(size, (b + 1)*block_size));
+	});
+}
+
+#endif
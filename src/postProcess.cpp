@@ -0,0 +1,428 @@
+#include "postProcess.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include <emmintrin.h>
+
+#include "parallel.hpp"
+
+namespace {
+
+const int TS = MAP_TILE_SIZE;
+static_assert(3*TS % 16 == 0, "Tile rows are quantized 16 values at a time");
+
+// Texel of a seed packed as x | y << 16
+const uint32_t no_seed = 0xFFFFFFFF;
+
+inline uint32_t packSeed(const int x, const int y)	{ return (uint32_t)x | (uint32_t)y << 16; }
+inline int seedX(const uint32_t s)					{ return s & 0xFFFF; }
+inline int seedY(const uint32_t s)					{ return s >> 16; }
+
+inline long long dist2(const int x, const int y, const uint32_t s) {
+	const long long dx = x - seedX(s), dy = y - seedY(s);
+	return dx*dx + dy*dy;
+}
+
+// Average of the samples of texel (x, y), false if it has none
+inline bool average(const TiledMap& map, const int x, const int y, float v[3]) {
+	const TiledMap::Tile* t = map.tile(x / TS, y / TS);
+	if(!t) return false;
+	const int k = x % TS + (y % TS)*TS;
+	const int count = t->count[k];
+	if(count == 0) return false;
+	v[0] = t->rgb[3*k + 0] / count;
+	v[1] = t->rgb[3*k + 1] / count;
+	v[2] = t->rgb[3*k + 2] / count;
+	return true;
+}
+
+// Nearest covered texel of every texel in the band of tiles within the dilation
+// distance of a touched tile, found by jump flooding. Tiles out of the band have no seeds.
+class SeedMap {
+public:
+	SeedMap(const TiledMap& map, const int dilation, const int threads_num);
+
+	bool inBand(const int tx, const int ty) const { return seeds[tx + ty*tiles_x] != nullptr; }
+
+	uint32_t seed(const int x, const int y) const {
+		const auto& t = seeds[x / TS + (y / TS)*tiles_x];
+		return t ? t[x % TS + (y % TS)*TS] : no_seed;
+	}
+
+private:
+	int tiles_x, tiles_y;
+	std::vector<std::unique_ptr<uint32_t[]>> seeds;
+};
+
+SeedMap::SeedMap(const TiledMap& map, const int dilation, const int threads_num) :
+	tiles_x{map.tilesX()}, tiles_y{map.tilesY()}, seeds(map.tilesX()*map.tilesY()) {
+
+	const int w = map.width();
+	const int h = map.height();
+
+	const int reach = (dilation + TS - 1) / TS;
+	std::vector<bool> in_band(seeds.size(), false);
+	for(int ty = 0; ty < tiles_y; ++ty) {
+		for(int tx = 0; tx < tiles_x; ++tx) {
+			if(!map.tile(tx, ty)) continue;
+			for(int ny = std::max(ty - reach, 0); ny <= std::min(ty + reach, tiles_y - 1); ++ny)
+				for(int nx = std::max(tx - reach, 0); nx <= std::min(tx + reach, tiles_x - 1); ++nx)
+					in_band[nx + ny*tiles_x] = true;
+		}
+	}
+
+	std::vector<int> band;
+	std::vector<std::unique_ptr<uint32_t[]>> next(seeds.size());
+	for(size_t i = 0; i < seeds.size(); ++i) {
+		if(!in_band[i]) continue;
+		band.push_back(i);
+		seeds[i].reset(new uint32_t[TS*TS]);
+		next[i].reset(new uint32_t[TS*TS]);
+	}
+
+	parallelFor(band.size(), threads_num, [&](const size_t b) {
+		const int i = band[b];
+		const int x0 = i % tiles_x * TS, y0 = i / tiles_x * TS;
+		const TiledMap::Tile* t = map.tile(i % tiles_x, i / tiles_x);
+		for(int k = 0; k < TS*TS; ++k)
+			seeds[i][k] = t && t->count[k] > 0 ? packSeed(x0 + k % TS, y0 + k / TS) : no_seed;
+	});
+
+	// Every step looks for a closer seed among the 8 texels step pixels away. The steps halve
+	// from the dilation distance down to 1, and an extra step of 1 fixes most of the remaining errors.
+	std::vector<int> steps;
+	int step = 1;
+	while(step < dilation) step *= 2;
+	for(; step >= 1; step /= 2)
+		steps.push_back(step);
+	steps.push_back(1);
+
+	for(const int step : steps) {
+		parallelFor(band.size(), threads_num, [&](const size_t b) {
+			const int i = band[b];
+			const int x0 = i % tiles_x * TS, y0 = i / tiles_x * TS;
+			for(int k = 0; k < TS*TS; ++k) {
+				const int x = x0 + k % TS, y = y0 + k / TS;
+				uint32_t best = seeds[i][k];
+				if(x >= w || y >= h) {
+					next[i][k] = best;
+					continue;
+				}
+				long long best_d = best == no_seed ? LLONG_MAX : dist2(x, y, best);
+				for(int dy = -step; dy <= step; dy += step) {
+					for(int dx = -step; dx <= step; dx += step) {
+						const int qx = x + dx, qy = y + dy;
+						if((dx == 0 && dy == 0) || qx < 0 || qy < 0 || qx >= w || qy >= h) continue;
+						const uint32_t s = seed(qx, qy);
+						if(s == no_seed) continue;
+						const long long d = dist2(x, y, s);
+						if(d < best_d) {
+							best = s;
+							best_d = d;
+						}
+					}
+				}
+				next[i][k] = best;
+			}
+		});
+		std::swap(seeds, next);
+	}
+}
+
+}
+
+void postProcessTiles(	const TiledMap&				map,
+						const PostProcessSettings&	settings,
+						const std::function<void(int tx, int ty, const float* values)>& emit) {
+
+	const int w = map.width();
+	const int h = map.height();
+	const float* flat = settings.empty;
+
+	std::unique_ptr<SeedMap> seeds;
+	if(settings.dilation > 0)
+		seeds.reset(new SeedMap(map, settings.dilation, settings.threads_num));
+	const long long max_d2 = (long long)settings.dilation*settings.dilation;
+
+	// Averaged and padded value of texel (x, y)
+	const auto value = [&](const int x, const int y, float v[3]) {
+		if(average(map, x, y, v)) return;
+		if(seeds) {
+			const uint32_t s = seeds->seed(x, y);
+			if(s != no_seed && dist2(x, y, s) <= max_d2 && average(map, seedX(s), seedY(s), v)) return;
+		}
+		std::copy(flat, flat + 3, v);
+	};
+
+	// Tiles whose value can differ from flat
+	const auto hasData = [&](const int tx, const int ty) {
+		return seeds ? seeds->inBand(tx, ty) : map.tile(tx, ty) != nullptr;
+	};
+
+	const int tiles_x = map.tilesX();
+	const int tiles_y = map.tilesY();
+	parallelFor(tiles_x*tiles_y, settings.threads_num, [&](const size_t ti) {
+		const int tx = ti % tiles_x, ty = ti / tiles_x;
+		const int x0 = tx*TS, y0 = ty*TS;
+		alignas(16) float out[3*TS*TS];
+
+		// A tile with no data around it is flat, blurred or not
+		bool data = false;
+		for(int ny = std::max(ty - 1, 0); ny <= std::min(ty + 1, tiles_y - 1); ++ny)
+			for(int nx = std::max(tx - 1, 0); nx <= std::min(tx + 1, tiles_x - 1); ++nx)
+				data |= hasData(nx, ny);
+		if(!data) {
+			for(int k = 0; k < TS*TS; ++k)
+				std::copy(flat, flat + 3, out + 3*k);
+			emit(tx, ty, out);
+			return;
+		}
+
+		if(!settings.blur) {
+			for(int j = 0; j < TS; ++j)
+				for(int i = 0; i < TS; ++i)
+					value(std::min(x0 + i, w - 1), std::min(y0 + j, h - 1), out + 3*(i + j*TS));
+			emit(tx, ty, out);
+			return;
+		}
+
+		// The tile with a one texel border, clamped at the map edges
+		const int RS = 3*(TS + 2);
+		alignas(16) float in[RS*(TS + 2)];
+		alignas(16) float hor[RS*(TS + 2)];
+		for(int j = 0; j < TS + 2; ++j) {
+			const int y = std::min(std::max(y0 + j - 1, 0), h - 1);
+			for(int i = 0; i < TS + 2; ++i)
+				value(std::min(std::max(x0 + i - 1, 0), w - 1), y, in + j*RS + 3*i);
+		}
+
+		// Separable 1 2 1 tent. Neighbouring texels are 3 floats apart.
+		const __m128 two = _mm_set1_ps(2);
+		for(int j = 0; j < TS + 2; ++j) {
+			const float* r = in + j*RS;
+			for(int k = 3; k < 3*(TS + 1); k += 4) {
+				const __m128 sum = _mm_add_ps(	_mm_add_ps(_mm_loadu_ps(r + k - 3), _mm_loadu_ps(r + k + 3)),
+												_mm_mul_ps(two, _mm_loadu_ps(r + k)));
+				_mm_storeu_ps(hor + j*RS + k, sum);
+			}
+		}
+		const __m128 norm = _mm_set1_ps(1/16.0f);
+		for(int j = 0; j < TS; ++j) {
+			const float* r = hor + j*RS;
+			for(int k = 3; k < 3*(TS + 1); k += 4) {
+				const __m128 sum = _mm_add_ps(	_mm_add_ps(_mm_loadu_ps(r + k), _mm_loadu_ps(r + 2*RS + k)),
+												_mm_mul_ps(two, _mm_loadu_ps(r + RS + k)));
+				_mm_storeu_ps(out + 3*j*TS + k - 3, _mm_mul_ps(sum, norm));
+			}
+		}
+		emit(tx, ty, out);
+	});
+}
+
+void postProcessMap(	const TiledMap&				map,
+						const PostProcessSettings&	settings,
+						unsigned char*				out,
+						const int					stride) {
+	const int w = map.width();
+	const int h = map.height();
+
+	postProcessTiles(map, settings, [&](const int tx, const int ty, const float* values) {
+		const int x0 = tx*TS, y0 = ty*TS;
+		const int row_bytes = 3*(std::min(x0 + TS, w) - x0);
+
+		// Components repeat every 3 floats, so a 4 float step starts on any of them
+		__m128 scale[3], bias[3];
+		for(int c = 0; c < 3; ++c) {
+			const float* s = settings.scale;
+			const float* b = settings.bias;
+			scale[c] = _mm_setr_ps(s[c], s[(c + 1) % 3], s[(c + 2) % 3], s[c]);
+			bias[c] = _mm_setr_ps(b[c], b[(c + 1) % 3], b[(c + 2) % 3], b[c]);
+		}
+		alignas(16) unsigned char row[3*TS];
+		for(int j = 0; j < TS && y0 + j < h; ++j) {
+			// 16 values per step, saturated to 0 ... 255
+			const float* v = values + 3*j*TS;
+			for(int k = 0; k < 3*TS; k += 16) {
+				__m128i q[4];
+				for(int l = 0; l < 4; ++l) {
+					const int c = (k + 4*l) % 3;
+					q[l] = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_load_ps(v + k + 4*l), scale[c]), bias[c]));
+				}
+				const __m128i lo = _mm_packs_epi32(q[0], q[1]);
+				const __m128i hi = _mm_packs_epi32(q[2], q[3]);
+				_mm_store_si128(reinterpret_cast<__m128i*>(row + k), _mm_packus_epi16(lo, hi));
+			}
+			std::memcpy(out + (size_t)(h - y0 - j - 1)*stride + 3*(size_t)x0, row, row_bytes);
+		}
+	});
+}
+
+void postProcessMap16(	const TiledMap&				map,
+						const PostProcessSettings&	settings,
+						uint16_t*					out,
+						const int					stride) {
+	const int w = map.width();
+	const int h = map.height();
+
+	postProcessTiles(map, settings, [&](const int tx, const int ty, const float* values) {
+		const int x0 = tx*TS, y0 = ty*TS;
+		const int row_values = 3*(std::min(x0 + TS, w) - x0);
+
+		// 257 maps the 8 bit range on the 16 bit one
+		__m128 scale[3], bias[3];
+		for(int c = 0; c < 3; ++c) {
+			const float* s = settings.scale;
+			const float* b = settings.bias;
+			scale[c] = _mm_mul_ps(_mm_setr_ps(s[c], s[(c + 1) % 3], s[(c + 2) % 3], s[c]), _mm_set1_ps(257));
+			bias[c] = _mm_mul_ps(_mm_setr_ps(b[c], b[(c + 1) % 3], b[(c + 2) % 3], b[c]), _mm_set1_ps(257));
+		}
+		// SSE2 only packs to signed 16 bit, so values are shifted by 32768 and back
+		const __m128 lo = _mm_setzero_ps(), hi = _mm_set1_ps(65535);
+		const __m128i shift32 = _mm_set1_epi32(32768);
+		const __m128i shift16 = _mm_set1_epi16(-32768);
+		alignas(16) uint16_t row[3*TS];
+		for(int j = 0; j < TS && y0 + j < h; ++j) {
+			// 8 values per step, saturated to 0 ... 65535
+			const float* v = values + 3*j*TS;
+			for(int k = 0; k < 3*TS; k += 8) {
+				__m128i q[2];
+				for(int l = 0; l < 2; ++l) {
+					const int c = (k + 4*l) % 3;
+					const __m128 f = _mm_add_ps(_mm_mul_ps(_mm_load_ps(v + k + 4*l), scale[c]), bias[c]);
+					q[l] = _mm_sub_epi32(_mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(f, lo), hi)), shift32);
+				}
+				const __m128i packed = _mm_xor_si128(_mm_packs_epi32(q[0], q[1]), shift16);
+				_mm_store_si128(reinterpret_cast<__m128i*>(row + k), packed);
+			}
+			std::memcpy(out + (size_t)(h - y0 - j - 1)*stride + 3*(size_t)x0, row, row_values*sizeof(uint16_t));
+		}
+	});
+}
+
+void postProcessMapFloat(	const TiledMap&				map,
+							const PostProcessSettings&	settings,
+							float*						out,
+							const int					stride) {
+	const int w = map.width();
+	const int h = map.height();
+
+	postProcessTiles(map, settings, [&](const int tx, const int ty, const float* values) {
+		const int x0 = tx*TS, y0 = ty*TS;
+		const int row_values = 3*(std::min(x0 + TS, w) - x0);
+		for(int j = 0; j < TS && y0 + j < h; ++j)
+			std::memcpy(out + (size_t)(h - y0 - j - 1)*stride + 3*(size_t)x0, values + 3*j*TS, row_values*sizeof(float));
+	});
+}
+
+void downsampleMap(const TiledMap& map, TiledMap& dst, const bool unit_vectors, const int threads_num) {
+	const int w = map.width(), h = map.height();
+	dst.reset((w + 1) / 2, (h + 1) / 2);
+
+	parallelFor(dst.tilesX()*dst.tilesY(), threads_num, [&](const size_t ti) {
+		const int tx = ti % dst.tilesX(), ty = ti / dst.tilesX();
+		const int x0 = tx*TS, y0 = ty*TS;
+		const int x1 = std::min(x0 + TS, dst.width()), y1 = std::min(y0 + TS, dst.height());
+
+		// The source tiles under this one
+		bool any = false;
+		for(int sy = 2*ty; sy <= 2*ty + 1 && sy < map.tilesY(); ++sy)
+			for(int sx = 2*tx; sx <= 2*tx + 1 && sx < map.tilesX(); ++sx)
+				any |= map.tile(sx, sy) != nullptr;
+		if(!any) return;
+
+		TiledMap::Tile& t = dst.touch(tx, ty);
+		for(int y = y0; y < y1; ++y) {
+			for(int x = x0; x < x1; ++x) {
+				float sum[3] = {0, 0, 0};
+				int count = 0;
+				// With odd sizes the last row and column have a single source texel
+				for(int sy = 2*y; sy <= 2*y + 1 && sy < h; ++sy) {
+					for(int sx = 2*x; sx <= 2*x + 1 && sx < w; ++sx) {
+						const TiledMap::Tile* s = map.tile(sx / TS, sy / TS);
+						if(!s) continue;
+						const int k = sx % TS + (sy % TS)*TS;
+						for(int c = 0; c < 3; ++c) sum[c] += s->rgb[3*k + c];
+						count += s->count[k];
+					}
+				}
+				if(count == 0) continue;
+
+				if(unit_vectors) {
+					const float len = std::sqrt(sum[0]*sum[0] + sum[1]*sum[1] + sum[2]*sum[2]);
+					if(len > 0)
+						for(int c = 0; c < 3; ++c) sum[c] *= count / len;
+				}
+				const int k = (x - x0) + (y - y0)*TS;
+				for(int c = 0; c < 3; ++c) t.rgb[3*k + c] = sum[c];
+				t.count[k] = count;
+			}
+		}
+	});
+}
+
+void copyMapRegion(const TiledMap& map, const int x0, const int y0, TiledMap& dst, const int threads_num) {
+	parallelFor(dst.tilesX()*dst.tilesY(), threads_num, [&](const size_t ti) {
+		const int tx = ti % dst.tilesX(), ty = ti / dst.tilesX();
+		const int x1 = std::min((tx + 1)*TS, dst.width()), y1 = std::min((ty + 1)*TS, dst.height());
+		TiledMap::Tile* t = nullptr;
+		for(int y = ty*TS; y < y1; ++y) {
+			const int sy = y0 + y;
+			if(sy < 0 || sy >= map.height()) continue;
+			// Runs of texels within one source tile
+			for(int x = tx*TS; x < x1;) {
+				const int sx = x0 + x;
+				const int run = std::min(x1 - x, TS - sx % TS);
+				const TiledMap::Tile* s = sx >= 0 && sx < map.width() ? map.tile(sx / TS, sy / TS) : nullptr;
+				if(s) {
+					const int sk = sx % TS + (sy % TS)*TS;
+					if(!t && std::any_of(s->count + sk, s->count + sk + run, [](const int c) { return c > 0; }))
+						t = &dst.touch(tx, ty);
+					if(t) {
+						const int k = x % TS + (y % TS)*TS;
+						std::memcpy(t->rgb + 3*k, s->rgb + 3*sk, 3*run*sizeof(float));
+						std::memcpy(t->count + k, s->count + sk, run*sizeof(int));
+					}
+				}
+				x += run;
+			}
+		}
+	});
+}
+
+void mapRange(const TiledMap& map, float lo[3], float hi[3], const int threads_num) {
+	const int tiles = map.tilesX()*map.tilesY();
+	std::vector<float> tile_range(6*tiles);
+	std::vector<char> tile_any(tiles, 0);
+
+	parallelFor(tiles, threads_num, [&](const size_t ti) {
+		const TiledMap::Tile* t = map.tile(ti % map.tilesX(), ti / map.tilesX());
+		if(!t) return;
+		float* r = &tile_range[6*ti];
+		for(int k = 0; k < TS*TS; ++k) {
+			const int count = t->count[k];
+			if(count == 0) continue;
+			for(int c = 0; c < 3; ++c) {
+				const float v = t->rgb[3*k + c] / count;
+				r[c] = tile_any[ti] ? std::min(r[c], v) : v;
+				r[3 + c] = tile_any[ti] ? std::max(r[3 + c], v) : v;
+			}
+			tile_any[ti] = true;
+		}
+	});
+
+	bool any = false;
+	for(int c = 0; c < 3; ++c) lo[c] = hi[c] = 0;
+	for(int ti = 0; ti < tiles; ++ti) {
+		if(!tile_any[ti]) continue;
+		for(int c = 0; c < 3; ++c) {
+			lo[c] = any ? std::min(lo[c], tile_range[6*ti + c]) : tile_range[6*ti + c];
+			hi[c] = any ? std::max(hi[c], tile_range[6*ti + 3 + c]) : tile_range[6*ti + 3 + c];
+		}
+		any = true;
+	}
+}
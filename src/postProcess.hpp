@@ -0,0 +1,64 @@
+#ifndef _POST_PROCESS_HPP_
+#define _POST_PROCESS_HPP_
+
+#include <cstdint>
+#include <functional>
+
+#include "tiledMap.hpp"
+
+// Pixels the UV islands are padded by
+#define DEF_DILATION 16
+
+struct PostProcessSettings {
+	int		dilation;		// Pixels islands are padded by, 0 for none
+	bool	blur;			// 3x3 tent filter
+	int		threads_num;	// 0 means one per hardware thread
+
+	float	empty[3] = {0, 0, 1};			// Value of the texels far from any sample
+	float	scale[3] = {128, 128, 128};		// Quantization, v*scale + bias per component
+	float	bias[3] = {127, 127, 127};
+};
+
+// Turns the accumulated sums of map into final texel values, one tile at a time on
+// several threads. Every texel is averaged, then texels without samples take the
+// value of the nearest covered texel within settings.dilation pixels, found by jump
+// flooding, or settings.empty if there is none. The optional blur follows.
+// emit(tx, ty, values) runs on the worker threads for every tile, with MAP_TILE_SIZE
+// rows of 3*MAP_TILE_SIZE floats, of which only the texels inside the map are valid.
+void postProcessTiles(	const TiledMap&				map,
+						const PostProcessSettings&	settings,
+						const std::function<void(int tx, int ty, const float* values)>& emit);
+
+// Runs postProcessTiles and quantizes the result to 8 bit RGB, top row first
+// as v*settings.scale + settings.bias
+void postProcessMap(	const TiledMap&				map,
+						const PostProcessSettings&	settings,
+						unsigned char*				out,
+						const int					stride);
+
+// Same as postProcessMap, to 16 bit RGB. The 8 bit scale and bias are widened by 257.
+void postProcessMap16(	const TiledMap&				map,
+						const PostProcessSettings&	settings,
+						uint16_t*					out,
+						const int					stride);
+
+// Runs postProcessTiles and copies the unquantized values, top row first
+void postProcessMapFloat(	const TiledMap&				map,
+							const PostProcessSettings&	settings,
+							float*						out,
+							const int					stride);
+
+// Reduces map to half its size, rounded up, into dst, one tile of dst per job on threads_num threads.
+// Every texel of dst sums the samples and counts of the 2x2 texels under it, so its
+// average weighs them by their counts and texels without samples add nothing.
+// With unit_vectors the sums are rescaled to unit average length.
+void downsampleMap(const TiledMap& map, TiledMap& dst, const bool unit_vectors, const int threads_num);
+
+// Copies the dst.width() x dst.height() texels of map from (x0, y0) on into dst, one tile of
+// dst per job. Only the tiles of dst with samples are touched.
+void copyMapRegion(const TiledMap& map, const int x0, const int y0, TiledMap& dst, const int threads_num);
+
+// Per component range of the averaged texels of map. Both are 0 if it has no samples.
+void mapRange(const TiledMap& map, float lo[3], float hi[3], const int threads_num);
+
+#endif
@@ -0,0 +1,627 @@
+#include <sys/stat.h>
+
+#include <chrono>
+#include <cctype>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "bakeJob.hpp"
+#include "core.hpp"
+#include "image.hpp"
+
+// High poly scenes kept loaded between jobs
+#define DEF_SCENE_CACHE 4
+
+// Seconds between two progress events of a bake
+#define PROGRESS_INTERVAL 0.25
+
+typedef std::map<std::string, std::string> JsonFields;
+
+static void printUsage() {
+	std::cerr <<
+		"Usage: baker_server [options]\n"
+		"Bakes the jobs read from stdin, one JSON object per line, and writes one JSON event\n"
+		"per line to stdout. The high poly meshes and their BVHs of the last jobs stay loaded.\n"
+		"Options:\n"
+		"  --threads <n>            bake threads, 0 = one per core (default 0)\n"
+		"  --cache <n>              high poly scenes kept loaded (default 4)\n"
+		"  --mesh-cache <0|1>       use binary .bkmesh caches next to the OBJs (default 1)\n"
+		"  --embree-own-buffers <0|1>      Embree owns the high poly buffers, mesh copies are freed (default 0)\n"
+		"  --embree-compact <0|1>          compact BVH layout (default 0)\n"
+		"  --build-quality <low|medium|high>  BVH build quality (default medium)\n"
+		"  --hi-normals-low-precision <0|1>  32 bit encoded high poly normals (default 0)\n"
+		"Requests:\n"
+		"  {\"cmd\": \"bake\", \"id\": \"a\", \"low\": \"low.obj\", \"high\": \"high.obj\", \"out\": \"map.png\",\n"
+		"   \"size\": 2048, \"spp\": 4, ...}\n"
+		"      Optional fields, as the baker_cli options: channels, format, compression, bc_quality,\n"
+		"      pyramid, udim, dilation, blur, mode, bidirectional, ray_front, ray_back, adaptive,\n"
+		"      adaptive_initial, adaptive_threshold, ao_rays, ao_distance, ao_tolerance, stats\n"
+		"  {\"cmd\": \"cancel\", \"id\": \"a\"}   drops a queued job or stops the running one\n"
+		"  {\"cmd\": \"status\"}              queue and loaded scenes\n"
+		"  {\"cmd\": \"quit\"}                stops after the running job. End of input finishes the queue first.\n"
+		"Events: ready, queued, started, loaded, progress, output, done, cancelled, error, status.\n";
+}
+
+// Parses a flat JSON object of string, number and literal values. Strings are unescaped,
+// numbers and literals are kept as written.
+static bool parseJsonObject(const std::string& line, JsonFields& fields, std::string& error) {
+	size_t i = 0;
+	const auto skip = [&]() { while(i < line.size() && std::isspace((unsigned char)line[i])) ++i; };
+	const auto parseString = [&](std::string& s) {
+		if(line[i] != '"') return false;
+		for(++i; i < line.size() && line[i] != '"'; ++i) {
+			if(line[i] != '\\') {
+				s += line[i];
+				continue;
+			}
+			if(++i == line.size()) return false;
+			switch(line[i]) {
+				case 'n':	s += '\n'; break;
+				case 't':	s += '\t'; break;
+				case 'r':	s += '\r'; break;
+				case 'b':	s += '\b'; break;
+				case 'f':	s += '\f'; break;
+				case 'u': {
+					// Basic plane code points, as UTF-8
+					if(i + 4 >= line.size()) return false;
+					const unsigned cp = std::strtoul(line.substr(i + 1, 4).c_str(), nullptr, 16);
+					i += 4;
+					if(cp < 0x80) s += (char)cp;
+					else if(cp < 0x800) {
+						s += (char)(0xC0 | cp >> 6);
+						s += (char)(0x80 | (cp & 0x3F));
+					} else {
+						s += (char)(0xE0 | cp >> 12);
+						s += (char)(0x80 | ((cp >> 6) & 0x3F));
+						s += (char)(0x80 | (cp & 0x3F));
+					}
+					break;
+				}
+				default:	s += line[i];
+			}
+		}
+		if(i == line.size()) return false;
+		++i;
+		return true;
+	};
+
+	skip();
+	if(i == line.size() || line[i] != '{') {
+		error = "expected an object";
+		return false;
+	}
+	++i;
+	skip();
+	if(i < line.size() && line[i] == '}') return true;
+	while(i < line.size()) {
+		skip();
+		std::string key, value;
+		if(i == line.size() || !parseString(key)) {
+			error = "expected a key";
+			return false;
+		}
+		skip();
+		if(i == line.size() || line[i] != ':') {
+			error = "expected : after " + key;
+			return false;
+		}
+		++i;
+		skip();
+		if(i < line.size() && line[i] == '"') {
+			if(!parseString(value)) {
+				error = "unterminated string";
+				return false;
+			}
+		} else {
+			const size_t begin = i;
+			while(i < line.size() && line[i] != ',' && line[i] != '}' && !std::isspace((unsigned char)line[i])) ++i;
+			value = line.substr(begin, i - begin);
+			if(value.empty() || value[0] == '{' || value[0] == '[') {
+				error = "unsupported value of " + key;
+				return false;
+			}
+		}
+		fields[key] = value;
+		skip();
+		if(i < line.size() && line[i] == ',') {
+			++i;
+			continue;
+		}
+		if(i < line.size() && line[i] == '}') return true;
+		break;
+	}
+	error = "expected , or }";
+	return false;
+}
+
+static std::string jsonQuote(const std::string& s) {
+	std::string q = "\"";
+	for(const char c : s) {
+		switch(c) {
+			case '"':	q += "\\\""; break;
+			case '\\':	q += "\\\\"; break;
+			case '\n':	q += "\\n"; break;
+			case '\t':	q += "\\t"; break;
+			case '\r':	q += "\\r"; break;
+			default:
+				if((unsigned char)c < 0x20) {
+					char buf[8];
+					std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+					q += buf;
+				} else {
+					q += c;
+				}
+		}
+	}
+	return q + "\"";
+}
+
+// Builds one event line: {"id": ..., "event": ..., more fields}
+class Event {
+public:
+	Event(const std::string& id, const std::string& event) {
+		out << "{";
+		if(!id.empty()) out << "\"id\": " << jsonQuote(id) << ", ";
+		out << "\"event\": " << jsonQuote(event);
+	}
+	Event& add(const std::string& key, const std::string& value)	{ out << ", " << jsonQuote(key) << ": " << jsonQuote(value); return *this; }
+	Event& add(const std::string& key, const char* value)			{ return add(key, std::string(value)); }
+	Event& add(const std::string& key, const double value)			{ out << ", " << jsonQuote(key) << ": " << value; return *this; }
+	Event& add(const std::string& key, const long long value)		{ out << ", " << jsonQuote(key) << ": " << value; return *this; }
+	Event& add(const std::string& key, const int value)				{ return add(key, (long long)value); }
+	Event& add(const std::string& key, const size_t value)			{ return add(key, (long long)value); }
+	Event& add(const std::string& key, const bool value)			{ out << ", " << jsonQuote(key) << ": " << (value ? "true" : "false"); return *this; }
+	// Raw JSON, for arrays
+	Event& addRaw(const std::string& key, const std::string& json)	{ out << ", " << jsonQuote(key) << ": " << json; return *this; }
+
+	// Writes the event as one line. Events come from the reader and the bake threads.
+	void send() {
+		static std::mutex stdout_mutex;
+		std::lock_guard<std::mutex> lock{stdout_mutex};
+		std::cout << out.str() << "}" << std::endl;
+	}
+
+private:
+	std::ostringstream out;
+};
+
+static std::string field(const JsonFields& f, const std::string& key, const std::string& def = "") {
+	const auto it = f.find(key);
+	return it != f.end() ? it->second : def;
+}
+
+static double number(const JsonFields& f, const std::string& key, const double def) {
+	const auto it = f.find(key);
+	return it != f.end() ? std::atof(it->second.c_str()) : def;
+}
+
+static bool flag(const JsonFields& f, const std::string& key, const bool def) {
+	const auto it = f.find(key);
+	return it != f.end() ? it->second == "true" || it->second == "1" : def;
+}
+
+// Size and modification time of a file, which change whenever it is written.
+// The mesh caches trust the same pair to detect stale files.
+static bool fileSignature(const std::string& path, std::string& signature) {
+	struct stat st;
+	if(stat(path.c_str(), &st) != 0) return false;
+	signature = std::to_string((long long)st.st_size) + ":" + std::to_string((long long)st.st_mtime);
+	return true;
+}
+
+struct ServerSettings {
+	int				threads_num;
+	size_t			cache_size;
+	bool			use_mesh_cache;
+	bool			embree_own_buffers;
+	bool			embree_compact;
+	RTCBuildQuality	build_quality;
+	bool			hi_normals_low_precision;
+};
+
+// A loaded high poly mesh and BVH, with the Core that owns them and the low poly it last baked
+struct Scene {
+	std::string				path, signature;
+	std::string				low_path, low_signature;
+	std::unique_ptr<Core>	core;
+};
+
+struct Job {
+	std::string	id;
+	JsonFields	fields;
+};
+
+class Server {
+public:
+	explicit Server(const ServerSettings& settings) : settings{settings}, quitting{false}, input_done{false}, running_core{nullptr} {}
+
+	// Reads requests until quit or the end of input, baking on a worker thread meanwhile
+	void run() {
+		std::thread worker{[this]() { work(); }};
+		Event{"", "ready"}.add("cache", settings.cache_size).send();
+
+		std::string line;
+		while(!quitting && std::getline(std::cin, line)) {
+			if(line.find_first_not_of(" \t\r") == std::string::npos) continue;
+			JsonFields f;
+			std::string error;
+			if(!parseJsonObject(line, f, error)) {
+				Event{"", "error"}.add("message", "malformed request: " + error).send();
+				continue;
+			}
+			handle(f);
+		}
+
+		{
+			std::lock_guard<std::mutex> lock{mutex};
+			input_done = true;
+		}
+		wake.notify_all();
+		worker.join();
+	}
+
+private:
+	void handle(const JsonFields& f) {
+		const std::string cmd = field(f, "cmd");
+		const std::string id = field(f, "id");
+		if(cmd == "bake") {
+			for(const char* key : {"low", "high", "out"}) {
+				if(field(f, key).empty()) {
+					Event{id, "error"}.add("message", std::string("missing ") + key).send();
+					return;
+				}
+			}
+			size_t position;
+			{
+				std::lock_guard<std::mutex> lock{mutex};
+				queue.push_back({id, f});
+				position = queue.size();
+			}
+			Event{id, "queued"}.add("position", position).send();
+			wake.notify_all();
+		} else if(cmd == "cancel") {
+			cancel(id);
+		} else if(cmd == "status") {
+			std::lock_guard<std::mutex> lock{mutex};
+			std::string scene_list = "[";
+			for(const std::string& path : scene_paths)
+				scene_list += (scene_list.size() > 1 ? ", " : "") + jsonQuote(path);
+			Event{id, "status"}.add("queued", queue.size()).add("running", running_id)
+								.addRaw("scenes", scene_list + "]").send();
+		} else if(cmd == "quit") {
+			std::deque<Job> dropped;
+			{
+				std::lock_guard<std::mutex> lock{mutex};
+				quitting = true;
+				dropped.swap(queue);
+				if(running_core) running_core->cancelBake();
+			}
+			for(const Job& job : dropped)
+				Event{job.id, "cancelled"}.send();
+			wake.notify_all();
+		} else {
+			Event{id, "error"}.add("message", "unknown cmd " + cmd).send();
+		}
+	}
+
+	void cancel(const std::string& id) {
+		std::lock_guard<std::mutex> lock{mutex};
+		for(auto it = queue.begin(); it != queue.end(); ++it) {
+			if(it->id == id) {
+				queue.erase(it);
+				Event{id, "cancelled"}.send();
+				return;
+			}
+		}
+		if(running_id == id) {
+			cancel_running = true;
+			if(running_core) running_core->cancelBake();
+			return;
+		}
+		Event{id, "error"}.add("message", "no such job").send();
+	}
+
+	// Worker thread: runs the queued jobs in order. Every bake already uses all the
+	// bake threads, so jobs share them one after the other instead of competing.
+	void work() {
+		for(;;) {
+			Job job;
+			{
+				std::unique_lock<std::mutex> lock{mutex};
+				wake.wait(lock, [this]() { return quitting || input_done || !queue.empty(); });
+				if(quitting || queue.empty()) return;
+				job = std::move(queue.front());
+				queue.pop_front();
+				running_id = job.id;
+				cancel_running = false;
+			}
+			runJob(job);
+			{
+				std::lock_guard<std::mutex> lock{mutex};
+				running_id.clear();
+				running_core = nullptr;
+			}
+		}
+	}
+
+	// Most recently used scene for path, loading it if it is not cached or changed on disk
+	Scene* scene(const std::string& id, const std::string& path) {
+		std::string signature;
+		if(!fileSignature(path, signature)) {
+			Event{id, "error"}.add("message", "cannot open " + path).send();
+			return nullptr;
+		}
+
+		for(auto it = scenes.begin(); it != scenes.end(); ++it) {
+			if(it->path != path) continue;
+			if(it->signature == signature) {
+				scenes.splice(scenes.begin(), scenes, it);
+				Event{id, "loaded"}.add("mesh", "high").add("path", path).add("cached", true).send();
+				return &scenes.front();
+			}
+			scenes.erase(it);
+			break;
+		}
+
+		// Least recently used scenes go first
+		while(!scenes.empty() && scenes.size() >= settings.cache_size)
+			scenes.pop_back();
+		// The scenes dropped are gone even if the load fails
+		updateScenePaths();
+
+		Scene s;
+		s.path = path;
+		s.signature = signature;
+		s.core.reset(new Core);
+		Core& core = *s.core;
+		core.threads_num = settings.threads_num;
+		core.use_mesh_cache = settings.use_mesh_cache;
+		core.embree_own_buffers = settings.embree_own_buffers;
+		core.embree_compact = settings.embree_compact;
+		core.embree_build_quality = settings.build_quality;
+		core.hi_normals_low_precision = settings.hi_normals_low_precision;
+
+		const auto start = std::chrono::steady_clock::now();
+		if(!core.loadHighObj(path)) {
+			Event{id, "error"}.add("message", "cannot load " + path).send();
+			return nullptr;
+		}
+		const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		Event{id, "loaded"}.add("mesh", "high").add("path", path).add("cached", false)
+							.add("seconds", elapsed.count()).add("bvh_seconds", core.bvh_build_time).send();
+
+		scenes.push_front(std::move(s));
+		updateScenePaths();
+		return &scenes.front();
+	}
+
+	void updateScenePaths() {
+		std::lock_guard<std::mutex> lock{mutex};
+		scene_paths.clear();
+		for(const Scene& s : scenes)
+			scene_paths.push_back(s.path);
+	}
+
+	// Applies the map settings of a job, as the baker_cli options
+	static bool configure(Core& core, const JsonFields& f, std::string& error) {
+		unsigned channels = 1 << CHANNEL_NORMAL;
+		if(!parseChannels(field(f, "channels", "normal"), channels)) {
+			error = "unknown channel in " + field(f, "channels");
+			return false;
+		}
+		core.channels = channels;
+
+		const int size = number(f, "size", DEF_TEX_SIZE);
+		const int spp = number(f, "spp", DEF_SPP_SIDE*DEF_SPP_SIDE);
+		if(size <= 0 || spp <= 0) {
+			error = "size and spp must be positive";
+			return false;
+		}
+		core.tex_w = size;
+		core.tex_h = size;
+		core.spp_side = sppSide(spp);
+
+		const std::string mode = field(f, "mode", "packet");
+		if(mode != "packet" && mode != "stream") {
+			error = "unknown mode " + mode;
+			return false;
+		}
+		core.bake_mode = mode == "stream" ? BAKE_MODE_STREAM : BAKE_MODE_PACKET;
+
+		const std::string quality = field(f, "bc_quality", "normal");
+		if(quality != "fast" && quality != "normal" && quality != "high") {
+			error = "unknown bc_quality " + quality;
+			return false;
+		}
+		core.bc_quality = quality == "fast" ? BC_QUALITY_FAST : quality == "high" ? BC_QUALITY_HIGH : BC_QUALITY_NORMAL;
+
+		core.udim						= flag(f, "udim", false);
+		core.map_dilation				= number(f, "dilation", DEF_DILATION);
+		core.map_blur					= flag(f, "blur", true);
+		core.compression_level			= number(f, "compression", DEF_COMPRESSION_LEVEL);
+		core.bidirectional_rays			= flag(f, "bidirectional", false);
+		core.ray_front_distance			= number(f, "ray_front", 1);
+		core.ray_back_distance			= number(f, "ray_back", 1);
+		core.adaptive					= flag(f, "adaptive", false);
+		core.adaptive_initial_samples	= number(f, "adaptive_initial", 4);
+		core.adaptive_threshold			= number(f, "adaptive_threshold", 2);
+		core.ao_rays					= number(f, "ao_rays", DEF_AO_RAYS);
+		core.ao_max_distance			= number(f, "ao_distance", 0);
+		core.ao_tolerance				= number(f, "ao_tolerance", 0.02);
+		return true;
+	}
+
+	void runJob(const Job& job) {
+		const std::string& id = job.id;
+		const JsonFields& f = job.fields;
+		const auto start = std::chrono::steady_clock::now();
+		Event{id, "started"}.send();
+
+		ImageFormat format = IMAGE_PNG8;
+		const std::string format_name = field(f, "format", "png");
+		if(format_name == "png16")		format = IMAGE_PNG16;
+		else if(format_name == "tiff")	format = IMAGE_TIFF_FLOAT;
+		else if(format_name == "dds")	format = IMAGE_DDS_BC5;
+		else if(format_name != "png") {
+			Event{id, "error"}.add("message", "unknown format " + format_name).send();
+			return;
+		}
+		if(!matchesFormat(field(f, "out"), format)) {
+			Event{id, "error"}.add("message", std::string("out needs the extension ") + formatExtension(format)).send();
+			return;
+		}
+
+		Scene* s = scene(id, field(f, "high"));
+		if(!s) return;
+		Core& core = *s->core;
+		// Only the meshes and the BVH stay with the scene. The maps of a big bake take
+		// more memory than they do, so they are freed however the job ends.
+		struct ReleaseMaps {
+			Core& core;
+			~ReleaseMaps() { core.releaseBuffers(); }
+		} release_maps{core};
+		std::string error;
+		if(!configure(core, f, error)) {
+			Event{id, "error"}.add("message", error).send();
+			return;
+		}
+
+		// The low poly of the last job on this scene is often the one being iterated on
+		const std::string low = field(f, "low");
+		std::string low_signature;
+		if(!fileSignature(low, low_signature)) {
+			Event{id, "error"}.add("message", "cannot open " + low).send();
+			return;
+		}
+		const bool low_cached = s->low_path == low && s->low_signature == low_signature;
+		if(!low_cached) {
+			s->low_path.clear();
+			if(!core.loadLowObj(low)) {
+				Event{id, "error"}.add("message", "cannot load " + low).send();
+				return;
+			}
+			s->low_path = low;
+			s->low_signature = low_signature;
+		}
+		Event{id, "loaded"}.add("mesh", "low").add("path", low).add("cached", low_cached).send();
+
+		// Bakes on the core bake thread, reporting its progress from here. From now on a cancel
+		// reaches the core, and one that comes before startNormalMap stops the bake as it starts.
+		{
+			std::lock_guard<std::mutex> lock{mutex};
+			if(cancel_running || quitting) {
+				Event{id, "cancelled"}.send();
+				return;
+			}
+			running_core = &core;
+		}
+		core.clearBuffers();
+		std::mutex done_mutex;
+		std::condition_variable bake_done;
+		bool finished = false, baked = false;
+		core.startNormalMap([&](const bool done) {
+			std::lock_guard<std::mutex> lock{done_mutex};
+			baked = done;
+			finished = true;
+			bake_done.notify_one();
+		});
+		// Progress every interval, and once more as soon as the bake ends
+		{
+			std::unique_lock<std::mutex> lock{done_mutex};
+			for(bool ended = false; !ended; ) {
+				ended = bake_done.wait_for(lock, std::chrono::duration<double>(PROGRESS_INTERVAL),
+											[&]() { return finished; });
+				const BakeProgress p = core.bakeProgress();
+				Event{id, "progress"}.add("done", p.work_done).add("total", p.work_total).add("rays", p.rays)
+									.add("elapsed", p.elapsed).add("eta", p.eta).send();
+			}
+		}
+		// No cancel may reach the core after waitBake clears it, or it would stop the next job
+		{
+			std::lock_guard<std::mutex> lock{mutex};
+			running_core = nullptr;
+		}
+		core.waitBake();
+		if(!baked) {
+			Event{id, "cancelled"}.send();
+			return;
+		}
+
+		const std::string out = field(f, "out");
+		ImageEncodeStats encoded{};
+		const bool written = writeBakeOutputs(core, out, format, number(f, "pyramid", 0), encoded,
+			[&](const std::string& path) { Event{id, "output"}.add("path", path).send(); });
+		if(!written) {
+			Event{id, "error"}.add("message", "cannot write " + out).send();
+			return;
+		}
+		if(flag(f, "stats", true)) {
+			const std::string stats_path = replaceExtension(out, ".stats.json");
+			if(!writeBakeStatsJson(stats_path, core.bakeStats())) {
+				Event{id, "error"}.add("message", "cannot write " + stats_path).send();
+				return;
+			}
+			Event{id, "output"}.add("path", stats_path).send();
+		}
+
+		const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		Event{id, "done"}.add("ok", true).add("seconds", elapsed.count()).add("average_spp", core.average_spp).add("encoded_bytes", encoded.file_bytes).send();
+	}
+
+	const ServerSettings settings;
+
+	// Only the worker thread touches the scenes
+	std::list<Scene> scenes;	// Most recently used first
+
+	// Shared with the reader thread
+	std::mutex					mutex;
+	std::condition_variable		wake;
+	std::deque<Job>				queue;
+	std::vector<std::string>	scene_paths;
+	std::string					running_id;
+	bool						cancel_running;
+	bool						quitting;
+	bool						input_done;
+	Core*						running_core;
+};
+
+int main(int argc, char** argv) {
+	ServerSettings settings{0, DEF_SCENE_CACHE, true, false, false, RTC_BUILD_QUALITY_MEDIUM, false};
+
+	for(int i = 1; i < argc; ++i) {
+		const std::string arg = argv[i];
+		if(i + 1 >= argc) {
+			printUsage();
+			return 1;
+		}
+		const std::string val = argv[++i];
+
+		if		(arg == "--threads")					settings.threads_num = std::atoi(val.c_str());
+		else if	(arg == "--cache")						settings.cache_size = std::max(1, std::atoi(val.c_str()));
+		else if	(arg == "--mesh-cache")					settings.use_mesh_cache = val != "0";
+		else if	(arg == "--embree-own-buffers")			settings.embree_own_buffers = val != "0";
+		else if	(arg == "--embree-compact")				settings.embree_compact = val != "0";
+		else if	(arg == "--hi-normals-low-precision")	settings.hi_normals_low_precision = val != "0";
+		else if	(arg == "--build-quality" && val == "low")		settings.build_quality = RTC_BUILD_QUALITY_LOW;
+		else if	(arg == "--build-quality" && val == "medium")	settings.build_quality = RTC_BUILD_QUALITY_MEDIUM;
+		else if	(arg == "--build-quality" && val == "high")		settings.build_quality = RTC_BUILD_QUALITY_HIGH;
+		else {
+			printUsage();
+			return 1;
+		}
+	}
+
+	Server server{settings};
+	server.run();
+	return 0;
+}
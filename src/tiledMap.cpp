@@ -0,0 +1,64 @@
+#include "tiledMap.hpp"
+
+#include <cstring>
+#include <utility>
+
+TiledMap::TiledMap() :
+	w{0}, h{0}, tiles_x{0}, tiles_y{0} {}
+
+void TiledMap::reset(const int w, const int h) {
+	for(auto& t : tiles)
+		if(t) pool.push_back(std::move(t));
+
+	this->w = w;
+	this->h = h;
+	tiles_x = (w + MAP_TILE_SIZE - 1) / MAP_TILE_SIZE;
+	tiles_y = (h + MAP_TILE_SIZE - 1) / MAP_TILE_SIZE;
+	tiles.clear();
+	tiles.resize((size_t)tiles_x*tiles_y);
+	trim(tiles.size());
+}
+
+void TiledMap::trim(const size_t keep) {
+	if(pool.size() <= keep) return;
+	pool.resize(keep);
+	if(keep == 0) pool.shrink_to_fit();
+}
+
+void TiledMap::swap(TiledMap& other) {
+	std::swap(w, other.w);
+	std::swap(h, other.h);
+	std::swap(tiles_x, other.tiles_x);
+	std::swap(tiles_y, other.tiles_y);
+	tiles.swap(other.tiles);
+}
+
+TiledMap::Tile& TiledMap::touch(const int tx, const int ty) {
+	std::unique_ptr<Tile>& t = tiles[tx + ty*tiles_x];
+	if(!t) {
+		{
+			std::lock_guard<std::mutex> lock{pool_mutex};
+			if(!pool.empty()) {
+				t = std::move(pool.back());
+				pool.pop_back();
+			}
+		}
+		if(!t) t.reset(new Tile);
+		std::memset(t.get(), 0, sizeof(Tile));
+	}
+	return *t;
+}
+
+Vec3f TiledMap::texel(const int x, const int y, const Vec3f& missing) const {
+	const Tile* t = tile(x / MAP_TILE_SIZE, y / MAP_TILE_SIZE);
+	if(!t) return missing;
+	const int idx = 3*(x % MAP_TILE_SIZE + (y % MAP_TILE_SIZE)*MAP_TILE_SIZE);
+	return {t->rgb[idx + 0], t->rgb[idx + 1], t->rgb[idx + 2]};
+}
+
+size_t TiledMap::touchedTiles() const {
+	size_t n = 0;
+	for(const auto& t : tiles)
+		n += t != nullptr;
+	return n;
+}
@@ -0,0 +1,59 @@
+#ifndef _TILED_MAP_HPP_
+#define _TILED_MAP_HPP_
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "math.hpp"
+
+// Side in texels of the tiles of a TiledMap
+#define MAP_TILE_SIZE 64
+
+// RGB float map with a sample count per texel, split in square tiles that
+// are allocated on first touch. Texels outside the UV islands never cost
+// memory. Dropped tiles go to a pool and are reused by the next bake.
+class TiledMap {
+public:
+	struct Tile {
+		float	rgb[3*MAP_TILE_SIZE*MAP_TILE_SIZE];
+		int		count[MAP_TILE_SIZE*MAP_TILE_SIZE];
+	};
+
+	TiledMap();
+	TiledMap(const TiledMap&) = delete;
+	TiledMap& operator=(const TiledMap&) = delete;
+
+	// Resizes the map and moves all its tiles to the pool, keeping no more than it can use
+	void reset(const int w, const int h);
+	// Frees the pooled tiles beyond keep
+	void trim(const size_t keep = 0);
+	// Exchanges the sizes and tiles of two maps. Each keeps its own pool.
+	void swap(TiledMap& other);
+
+	// Tile (tx, ty), taken from the pool and zeroed on first touch.
+	// Different threads may touch different tiles at the same time.
+	Tile& touch(const int tx, const int ty);
+	// Null if the tile was never touched
+	Tile*		tile(const int tx, const int ty)		{ return tiles[tx + ty*tiles_x].get(); }
+	const Tile*	tile(const int tx, const int ty) const	{ return tiles[tx + ty*tiles_x].get(); }
+
+	// Value of texel (x, y), or missing if its tile was never touched
+	Vec3f texel(const int x, const int y, const Vec3f& missing) const;
+
+	int width() const	{ return w; }
+	int height() const	{ return h; }
+	int tilesX() const	{ return tiles_x; }
+	int tilesY() const	{ return tiles_y; }
+
+	size_t touchedTiles() const;
+
+private:
+	int w, h, tiles_x, tiles_y;
+
+	std::vector<std::unique_ptr<Tile>> tiles;
+	std::vector<std::unique_ptr<Tile>> pool;
+	std::mutex pool_mutex;
+};
+
+#endif